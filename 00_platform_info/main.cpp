@@ -2,6 +2,7 @@
 
 #include <cl.hpp>
 #include <util.hpp>
+#include <program.hpp>
 
 #include <vector>
 #include <fstream>
@@ -10,6 +11,17 @@
 #include <string>
 #include <cstdio>
 
+/* ========== Kernels embarqus (voir Makefile) ========== */
+
+static const char vaddSource[] =
+#include "vadd.cl.inc"
+  ;
+static const unsigned char vaddSpirv[] = {
+#include "vadd.spv.inc"
+  0 };
+
+const kite::ProgramSource vaddProgram = { "vadd.cl", vaddSource, vaddSpirv, sizeof(vaddSpirv) - 1 };
+
 void printKernelInfo(const cl::Kernel& kernel, const cl::Device& device)
 {
   //size_t kernelGlobalWorkSizes[3];
@@ -150,28 +162,22 @@ int main(int argc, char **argv)
   fprintf(stderr, "\r\n");
 
   // Programme
-  const std::string programFile = "vadd.cl";
-  fprintf(stderr, "Chargement du programme '%s'... ", programFile.c_str());
+  fprintf(stderr, "Chargement du programme '%s'... ", vaddProgram.name);
 
   cl::Program program;
+  bool programFromIL = false;
   try
   {
-    program = cl::Program(context, util::loadProgram(programFile));
-    program.build();
+    program = kite::buildProgram(context, devices, vaddProgram, "", &programFromIL);
   }
   catch (...)
   {
-    std::string log;
-
-    program.getBuildInfo(devices[0], CL_PROGRAM_BUILD_LOG, &log);
-
     fprintf(stderr, "Echec\r\n");
-    fprintf(stderr, "\r\n%s\r\n", log.c_str());
 
     return EXIT_FAILURE;
   }
 
-  fprintf(stderr, "OK\r\n");
+  fprintf(stderr, "OK (%s)\r\n", programFromIL ? "SPIR-V" : "source");
 
   // Kernel initialization & invocation
   const size_t vecLength = 4;
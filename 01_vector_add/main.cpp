@@ -2,13 +2,33 @@
 
 #include <cl.hpp>
 #include <util.hpp>
+#include <trace.hpp>
+#include <program.hpp>
+#include <counters.hpp>
+#include <deviceselect.hpp>
+#include <fission.hpp>
 
 #include <vector>
 #include <fstream>
 #include <iostream>
 #include <streambuf>
 #include <string>
+#include <algorithm>
+#include <limits>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/* ========== Kernels embarqus (voir Makefile) ========== */
+
+static const char vaddSource[] =
+#include "vadd.cl.inc"
+  ;
+static const unsigned char vaddSpirv[] = {
+#include "vadd.spv.inc"
+  0 };
+
+const kite::ProgramSource vaddProgram = { "vadd.cl", vaddSource, vaddSpirv, sizeof(vaddSpirv) - 1 };
 
 void printKernelInfo(const cl::Kernel& kernel, const cl::Device& device)
 {
@@ -114,10 +134,257 @@ void printAllPlaformInfo()
   fprintf(stderr, "------------------------------------------------------\r\n");
 }
 
+/* ========== Vector width ========== */
+
+/**
+ * Largeur de vecteur float des kernels vaddN adapte au device: la plus grande des
+ * largeurs prfre et native, arrondie  16, 8, 4 ou 1 (kernel scalaire).
+ */
+int chooseVectorWidth(const cl::Device& device)
+{
+  cl_uint preferredWidth;
+  cl_uint nativeWidth;
+  cl_uint width;
+
+  device.getInfo(CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT, &preferredWidth);
+  device.getInfo(CL_DEVICE_NATIVE_VECTOR_WIDTH_FLOAT, &nativeWidth);
+
+  width = std::max(preferredWidth, nativeWidth);
+
+  if (width >= 16)
+    return 16;
+  if (width >= 8)
+    return 8;
+  if (width >= 4)
+    return 4;
+
+  return 1;
+}
+
+const char* vaddKernelName(int vectorWidth)
+{
+  switch (vectorWidth)
+  {
+  case 16: return "vadd16";
+  case 8: return "vadd8";
+  case 4: return "vadd4";
+  default: return "vadd_stride";
+  }
+}
+
+/**
+ * Taille globale d'un kernel "grid stride" dimensionne au device: quelques work groups
+ * p/ unit de calcul, sans dpasser le nombre d'items  traiter (au moins 16 work items
+ * pour la fin scalaire des kernels vaddN).
+ */
+size_t gridStrideGlobalSize(const cl::Kernel& kernel, const cl::Device& device, size_t items, size_t* localSize)
+{
+  cl_uint computeUnits;
+  size_t kernelWorkGroupSize;
+  size_t groups;
+
+  const size_t groupsPerComputeUnit = 4;
+
+  device.getInfo(CL_DEVICE_MAX_COMPUTE_UNITS, &computeUnits);
+  kernel.getWorkGroupInfo(device, CL_KERNEL_WORK_GROUP_SIZE, &kernelWorkGroupSize);
+
+  *localSize = std::min(kernelWorkGroupSize, (size_t)256);
+
+  groups = std::min((size_t)computeUnits * groupsPerComputeUnit, (items + *localSize - 1) / *localSize);
+  groups = std::max(groups, (16 + *localSize - 1) / *localSize);
+
+  return groups * *localSize;
+}
+
+/**
+ * d = a + b + c rparti par tranches sur les sous-devices NUMA: chaque sous-device
+ * possde sa file et ses tranches de a, b, c et d, remplies (first touch) par une
+ * commande de sa propre file. Retourne la dure du kernel en secondes.
+ */
+double runNumaVectorAdd(const std::vector<cl::Device>& subDevices, const kite::ProgramSource& programSource,
+			size_t vecLength, bool* verified)
+{
+  int partCount = subDevices.size();
+
+  std::vector<size_t> counts(partCount);
+  std::vector<cl::CommandQueue> queues;
+  std::vector<cl::Kernel> kernels;
+  std::vector<cl::Buffer> d_a, d_b, d_c, d_d;
+
+  cl::Context context(subDevices);
+  cl::Program program = kite::buildProgram(context, subDevices, programSource);
+
+  for (int p = 0; p < partCount; ++p)
+  {
+    size_t begin;
+    size_t bytes;
+
+    kite::splitRange(vecLength, partCount, p, &begin, &counts[p]);
+    bytes = sizeof(float) * std::max(counts[p], (size_t)1);
+
+    queues.push_back(cl::CommandQueue(context, subDevices[p], CL_QUEUE_PROFILING_ENABLE));
+    kernels.push_back(cl::Kernel(program, "vadd"));
+
+    d_a.push_back(cl::Buffer(context, CL_MEM_READ_ONLY, bytes));
+    d_b.push_back(cl::Buffer(context, CL_MEM_READ_ONLY, bytes));
+    d_c.push_back(cl::Buffer(context, CL_MEM_READ_ONLY, bytes));
+    d_d.push_back(cl::Buffer(context, CL_MEM_WRITE_ONLY, bytes));
+
+    queues[p].enqueueFillBuffer(d_a[p], 0.0f, 0, bytes);
+    queues[p].enqueueFillBuffer(d_b[p], 1.0f, 0, bytes);
+    queues[p].enqueueFillBuffer(d_c[p], -1.0f, 0, bytes);
+  }
+  for (int p = 0; p < partCount; ++p)
+    queues[p].finish();
+
+  util::Timer timer;
+
+  for (int p = 0; p < partCount; ++p)
+  {
+    if (counts[p] == 0)
+      continue;
+
+    kernels[p].setArg(0, d_a[p]);
+    kernels[p].setArg(1, d_b[p]);
+    kernels[p].setArg(2, d_c[p]);
+    kernels[p].setArg(3, d_d[p]);
+
+    kite::enqueueKernel(queues[p], kernels[p], cl::NDRange(counts[p]), cl::NullRange, NULL,
+			"vadd[" + std::to_string(p) + "]",
+			kite::KernelCost(2.0 * counts[p], 4.0 * sizeof(float) * counts[p]));
+  }
+  for (int p = 0; p < partCount; ++p)
+    queues[p].flush();
+  for (int p = 0; p < partCount; ++p)
+    queues[p].finish();
+
+  double seconds = timer.getTimeMicroseconds() * 1e-6;
+
+  *verified = true;
+  for (int p = 0; p < partCount && *verified; ++p)
+  {
+    std::vector<float> h_d(counts[p]);
+
+    if (counts[p] == 0)
+      continue;
+
+    kite::enqueueRead(queues[p], d_d[p], 0, sizeof(float) * counts[p], &h_d[0], NULL,
+		      "Read d[" + std::to_string(p) + "]", true);
+
+    for (size_t i = 0; i < counts[p]; ++i)
+      if (h_d[i] != 0)
+      {
+	*verified = false;
+	break;
+      }
+  }
+
+  return seconds;
+}
+
+/**
+ * Mode NUMA: un sous-device et une file par noeud NUMA du premier device CPU.
+ * 'scaling' vaut NULL (une excution sur tous les sous-devices), "strong" ou "weak".
+ */
+int runNumaMode(const std::vector<cl::Device>& devices, size_t vecLength, const char* scaling)
+{
+  bool verified;
+  cl::Device cpuDevice;
+
+  if (!kite::findCpuDevice(devices, &cpuDevice))
+  {
+    fprintf(stderr, "Mode NUMA: aucun device CPU dans le contexte\r\n");
+    return EXIT_FAILURE;
+  }
+
+  std::vector<cl::Device> subDevices = kite::createNumaSubDevices(cpuDevice);
+  kite::printSubDevices(subDevices);
+
+  if (scaling != NULL)
+  {
+    verified = true;
+    kite::runScaling(subDevices, vecLength, strcmp(scaling, "weak") == 0,
+		     [&](const std::vector<cl::Device>& parts, size_t length)
+		     {
+		       bool partVerified;
+		       double seconds = runNumaVectorAdd(parts, vaddProgram, length, &partVerified);
+
+		       verified = verified && partVerified;
+		       return seconds;
+		     });
+  }
+  else
+  {
+    double seconds = runNumaVectorAdd(subDevices, vaddProgram, vecLength, &verified);
+
+    printf("Kernel 'vadd' execute en %.0f us sur %lu sous-device(s)\r\n", seconds * 1e6, subDevices.size());
+    printf("\r\n");
+  }
+
+  printf("Resultat: %s\r\n", verified ? "OK" : "ERREUR");
+  printf("\r\n");
+
+  kite::Counters::instance().printReport();
+  kite::Trace::instance().write();
+
+  return verified ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 int main(int argc, char **argv)
 {
+  // --verbose: description complete des plateformes et des devices
+  // --roofline: mesure des performances crete du device pour le rapport des compteurs
+  // --numa: addition rpartie sur un sous-device par noeud NUMA du device CPU
+  // --numa-scaling strong|weak: passage  l'chelle sur 1..N sous-devices NUMA
+  // --length n: nombre d'lments (dfaut 2^24 + 3, pour exercer le traitement scalaire de la fin)
+  // --width 1|4|8|16: largeur de vecteur impose au lieu de celle prfre par le device
+  bool verbose = false;
+  bool roofline = false;
+  bool numa = false;
+  const char* numaScaling = NULL;
+  size_t vecLength = (1 << 24) + 3;
+  int vectorWidth = 0;
+  const char* widthName = NULL;
+  for (int i = 1; i < argc; ++i)
+    if (strcmp(argv[i], "--verbose") == 0)
+      verbose = true;
+    else if (strcmp(argv[i], "--roofline") == 0)
+      roofline = true;
+    else if (strcmp(argv[i], "--length") == 0 && i + 1 < argc)
+      vecLength = strtoul(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "--width") == 0 && i + 1 < argc)
+      widthName = argv[++i];
+    else if (strcmp(argv[i], "--numa") == 0)
+      numa = true;
+    else if (strcmp(argv[i], "--numa-scaling") == 0 && i + 1 < argc)
+      numaScaling = argv[++i];
+
+  if (numaScaling != NULL && strcmp(numaScaling, "strong") != 0 && strcmp(numaScaling, "weak") != 0)
+  {
+    fprintf(stderr, "--numa-scaling attend strong ou weak\r\n");
+    return EXIT_FAILURE;
+  }
+
+  // Les kernels recoivent la longueur en cl_uint
+  if (vecLength == 0 || vecLength > 0xffffffffUL)
+  {
+    fprintf(stderr, "--length doit etre compris entre 1 et 2^32 - 1\r\n");
+    return EXIT_FAILURE;
+  }
+
+  if (widthName != NULL)
+  {
+    if (strcmp(widthName, "1") != 0 && strcmp(widthName, "4") != 0 && strcmp(widthName, "8") != 0 && strcmp(widthName, "16") != 0)
+    {
+      fprintf(stderr, "--width attend 1, 4, 8 ou 16\r\n");
+      return EXIT_FAILURE;
+    }
+    vectorWidth = atoi(widthName);
+  }
+
   // Contexte
-  printAllPlaformInfo();
+  if (verbose)
+    printAllPlaformInfo();
 
   fprintf(stderr, "Initialisation du contexte OpenCL... ");
 
@@ -133,92 +400,129 @@ int main(int argc, char **argv)
   fprintf(stderr, "OK\r\n");
 
   fprintf(stderr, "\r\n");
-  for (int i = 0; i < devices.size(); ++i)
+  if (verbose)
   {
-    fprintf(stderr, "--------------- Context Device[%d] ---------------\r\n", i);
-    printDeviceInfo(devices[i]);
+    for (int i = 0; i < devices.size(); ++i)
+    {
+      fprintf(stderr, "--------------- Context Device[%d] ---------------\r\n", i);
+      printDeviceInfo(devices[i]);
+    }
+    fprintf(stderr, "\r\n");
   }
-  fprintf(stderr, "\r\n");
+
+  if (numa || numaScaling != NULL)
+    return runNumaMode(devices, 1 << 24, numaScaling);
 
   // File de commandes
-  const int queueDeviceId = 0;
-  fprintf(stderr, "Initialisation d'une file de commandes pour le device %d... ", queueDeviceId);
+  const size_t queueDeviceId = kite::selectDevice(devices);
+  fprintf(stderr, "Initialisation d'une file de commandes pour le device %lu... ", queueDeviceId);
 
-  cl::CommandQueue queue(context, devices[queueDeviceId]);
+  cl::CommandQueue queue(context, devices[queueDeviceId], CL_QUEUE_PROFILING_ENABLE);
 
   fprintf(stderr, "OK\r\n");
   fprintf(stderr, "\r\n");
 
   // Programme
-  const std::string programFile = "vadd.cl";
-  fprintf(stderr, "Chargement du programme '%s'... ", programFile.c_str());
+  fprintf(stderr, "Chargement du programme '%s'... ", vaddProgram.name);
 
   cl::Program program;
+  bool programFromIL = false;
   try
   {
-    program = cl::Program(context, util::loadProgram(programFile));
-    program.build();
+    kite::TraceSpan span(std::string("Build ") + vaddProgram.name);
+
+    program = kite::buildProgram(context, devices, vaddProgram, "", &programFromIL);
   }
   catch (...)
   {
-    std::string log;
-
-    program.getBuildInfo(devices[0], CL_PROGRAM_BUILD_LOG, &log);
-
     fprintf(stderr, "Echec\r\n");
-    fprintf(stderr, "\r\n%s\r\n", log.c_str());
 
     return EXIT_FAILURE;
   }
 
-  fprintf(stderr, "OK\r\n");
+  fprintf(stderr, "OK (%s)\r\n", programFromIL ? "SPIR-V" : "source");
 
   // Kernel initialization & invocation
-  const size_t vecLength = 4;
-  const char* kernelName = "vadd";
+  if (vectorWidth == 0)
+    vectorWidth = chooseVectorWidth(devices[queueDeviceId]);
 
+  const char* kernelName = vaddKernelName(vectorWidth);
+
+  // Valeurs distinctes p/ lment: un lment oubli (fin scalaire comprise) ou
+  // mal plac est dtect
   std::vector<float> h_a(vecLength);
   std::vector<float> h_b(vecLength);
   std::vector<float> h_c(vecLength);
   std::vector<float> h_d(vecLength);
 
-  h_a[0] = 0;
-  h_a[1] = 0;
-  h_a[2] = 0;
-  h_a[3] = 0;
+  for (size_t i = 0; i < vecLength; ++i)
+  {
+    h_a[i] = i;
+    h_b[i] = 2.0f * i;
+    h_c[i] = -(float)i;
+  }
 
-  h_b[0] = 1;
-  h_b[1] = 1;
-  h_b[2] = 1;
-  h_b[3] = 1;
+  kite::Trace& trace = kite::Trace::instance();
+  cl::Event event;
 
-  h_c[0] = -1;
-  h_c[1] = -1;
-  h_c[2] = -1;
-  h_c[3] = -1;
+  double buffersBeginUs = trace.nowUs();
 
-  cl::Buffer d_a(context, h_a.begin(), h_a.end(), true);
-  cl::Buffer d_b(context, h_b.begin(), h_b.end(), true);
-  cl::Buffer d_c(context, h_c.begin(), h_c.end(), true);
+  cl::Buffer d_a(context, CL_MEM_READ_ONLY, sizeof(float) * vecLength);
+  cl::Buffer d_b(context, CL_MEM_READ_ONLY, sizeof(float) * vecLength);
+  cl::Buffer d_c(context, CL_MEM_READ_ONLY, sizeof(float) * vecLength);
   cl::Buffer d_d(context, CL_MEM_READ_WRITE, sizeof(float) * vecLength);
 
+  trace.recordHostSpan("Creation des buffers", "host", buffersBeginUs, trace.nowUs());
+
+  kite::enqueueWrite(queue, d_a, 0, sizeof(float) * vecLength, &h_a[0], NULL, "Write a");
+  kite::enqueueWrite(queue, d_b, 0, sizeof(float) * vecLength, &h_b[0], NULL, "Write b");
+  kite::enqueueWrite(queue, d_c, 0, sizeof(float) * vecLength, &h_c[0], NULL, "Write c");
+
+  // d non crite par le kernel reste NaN, jamais gale au rsultat attendu
+  queue.enqueueFillBuffer(d_d, std::numeric_limits<float>::quiet_NaN(), 0, sizeof(float) * vecLength);
+
   cl::Kernel vaddKernel(program, kernelName);
-  printKernelInfo(vaddKernel, devices[0]);
+  printKernelInfo(vaddKernel, devices[queueDeviceId]);
 
-  cl::make_kernel<cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer> vaddFunc(vaddKernel);
+  cl::make_kernel<cl_uint, cl::Buffer, cl::Buffer, cl::Buffer, cl::Buffer> vaddFunc(vaddKernel);
+
+  size_t localSize;
+  size_t globalSize = gridStrideGlobalSize(vaddKernel, devices[queueDeviceId], (vecLength + vectorWidth - 1) / vectorWidth, &localSize);
+
+  printf("Kernel '%s': %lu elements, %lu work items (work groups de %lu)\r\n", kernelName, vecLength, globalSize, localSize);
 
   util::Timer timer;
 
-  vaddFunc(cl::EnqueueArgs(queue, vecLength), d_a, d_b, d_c, d_d);
+  event = vaddFunc(cl::EnqueueArgs(queue, cl::NDRange(globalSize), cl::NDRange(localSize)), (cl_uint)vecLength, d_a, d_b, d_c, d_d);
+  kite::recordLaunch(queue, event, kernelName, kite::KernelCost(2 * vecLength, 4 * sizeof(float) * vecLength));
 
   queue.finish();
 
-  cl::copy(queue, d_d, h_d.begin(), h_d.end());
+  kite::enqueueRead(queue, d_d, 0, sizeof(float) * vecLength, &h_d[0], NULL, "Read d", true);
 
   printf("Kernel '%s' execute en %ld ms\r\n", kernelName, timer.getTimeMilliseconds());
 
   for (int i = 0; i < 4; ++i)
     printf("h_d[%d] = %f\r\n", i, h_d[i]);
 
-  return EXIT_SUCCESS;
+  size_t errors = 0;
+  for (size_t i = 0; i < vecLength; ++i)
+    if (h_d[i] != h_a[i] + h_b[i] + h_c[i])
+    {
+      if (errors == 0)
+	printf("h_d[%lu] = %f, attendu %f\r\n", i, h_d[i], h_a[i] + h_b[i] + h_c[i]);
+      ++errors;
+    }
+
+  bool verified = errors == 0;
+  printf("Resultat: %s (%lu erreur(s))\r\n", verified ? "OK" : "ERREUR", errors);
+  printf("\r\n");
+
+  if (roofline)
+    kite::Counters::instance().setDevicePeaks(kite::measureDevicePeaks(context, devices[queueDeviceId]));
+  kite::Counters::instance().printReport();
+
+  trace.write();
+
+  return verified ? EXIT_SUCCESS : EXIT_FAILURE;
 }
@@ -5,4 +5,47 @@ __kernel void vadd(__global const float *a,
 {
     int gid = get_global_id(0);
     d[gid]  = a[gid] + b[gid] + c[gid];
-}
\ No newline at end of file
+}
+
+/**
+ * d = a + b + c sur n éléments, 1 élément à la fois, avec un pas égal à la
+ * taille globale ("grid stride"): la taille globale ne dépend pas de n. L'indice est
+ * un ulong: en uint, i + taille globale déborderait pour n proche de 2^32.
+ */
+__kernel void vadd_stride(const uint n,
+						  __global const float *a,
+						  __global const float *b,
+						  __global const float *c,
+						  __global       float *d)
+{
+    ulong i;
+
+    for (i = get_global_id(0); i < n; i += get_global_size(0))
+        d[i] = a[i] + b[i] + c[i];
+}
+
+/**
+ * Variantes vectorielles de vadd_stride par vecteurs de N floats (vloadN/vstoreN).
+ * Les n % N derniers éléments sont traités en scalaire par les premiers work items.
+ */
+#define VADD_VECTOR(N)															\
+__kernel void vadd##N(const uint n,												\
+					  __global const float *a,									\
+					  __global const float *b,									\
+					  __global const float *c,									\
+					  __global       float *d)									\
+{																				\
+    ulong i;																	\
+    uint vectors = n / N;														\
+																				\
+    for (i = get_global_id(0); i < vectors; i += get_global_size(0))			\
+        vstore##N(vload##N(i, a) + vload##N(i, b) + vload##N(i, c), i, d);		\
+																				\
+    i = vectors * N + get_global_id(0);											\
+    if (i < n)																	\
+        d[i] = a[i] + b[i] + c[i];												\
+}
+
+VADD_VECTOR(4)
+VADD_VECTOR(8)
+VADD_VECTOR(16)
\ No newline at end of file
@@ -2,13 +2,40 @@
 
 #include <cl.hpp>
 #include <util.hpp>
+#include <trace.hpp>
+#include <program.hpp>
+#include <taskgraph.hpp>
+#include <counters.hpp>
+#include <fission.hpp>
+#include <matrixfile.hpp>
+#include <fill.hpp>
+#include <deviceselect.hpp>
+#include <programcache.hpp>
 
 #include <vector>
 #include <fstream>
 #include <iostream>
 #include <streambuf>
 #include <string>
+#include <random>
+#include <algorithm>
+#include <cmath>
+#include <cfloat>
+#include <climits>
 #include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+
+/* ========== Kernels embarqus (voir Makefile) ========== */
+
+static const char mmulSource[] =
+#include "mmul.cl.inc"
+  ;
+static const unsigned char mmulSpirv[] = {
+#include "mmul.spv.inc"
+  0 };
+
+const kite::ProgramSource mmulProgram = { "mmul.cl", mmulSource, mmulSpirv, sizeof(mmulSpirv) - 1 };
 
 /* ========== Platform/Kernel infos ========== */
 
@@ -135,241 +162,1195 @@ bool isIdentity(const int size, const std::vector<float>& m)
 
   return true;
 }
-void setIdentity(const int size, std::vector<float>& m)
+void printMatrix(const int size, const std::vector<float>& m)
 {
   int r;
   int c;
 
   for (r = 0; r < size; ++r)
+  {
     for (c = 0; c < size; ++c)
-      m[r * size + c] = (r == c) ? 1 : 0;
+      printf("%f\t", m[r * size + c]);
+    printf("\r\n");
+  }
 }
-void setNull(std::vector<float>& m)
+
+/* ========== Kernel executions ========== */
+
+struct MatrixMulVariant
 {
-  int i;
+  const char* kernelName;
+  const char* description;
+  bool rowPerWorkItem;		// 1 ligne de C p/ work item (N work items), sinon 1 case p/ work item (NxN work items)
+  bool privateRow;		// Ligne de m1 copie en mmoire prive
+  bool localColumn;		// Colonne de m2 en mmoire locale (argument __local supplmentaire)
+};
+
+const MatrixMulVariant matrixMulVariants[] =
+{
+  { "mmul_cij_gmem", "C(i,j) p/ work item (NxN work items), Global memory", false, false, false },
+  { "mmul_ci_gmem", "C(i,*) p/ work item (N work items), Global memory", true, false, false },
+  { "mmul_ci_pmemr_gmemc", "C(i,*) p/ work item (N work items), Row in private memory", true, true, false },
+  { "mmul_ci_pmemr_lmemc", "C(i,*) p/ work item (N work items), Private row, Local column", true, true, true }
+};
+const int matrixMulVariantCount = sizeof(matrixMulVariants) / sizeof(matrixMulVariants[0]);
+
+/**
+ * Cout thorique d'un produit de matrices carres d'ordre N: 2N^3 flops, et les accs
+ * en mmoire globale rellement effectus par chaque kernel (C(i,j) est accumul en
+ * mmoire globale: 1 lecture + 1 criture par itration).
+ */
+kite::KernelCost matrixMulCost(const MatrixMulVariant& variant, int order)
+{
+  double n = order;
+  double groupCount = 4;	// Work groups de N/4 work items
+  double accesses;
+
+  if (variant.localColumn)
+    accesses = n * n			// Copie prive des lignes de m1
+      + groupCount * n * n		// Copie locale des colonnes de m2, 1 p/ work group
+      + n * n * (2 * n + 1);		// Accumulation dans C
+  else if (variant.privateRow)
+    accesses = n * n			// Copie prive des lignes de m1
+      + n * n * (3 * n + 1);		// m2 + accumulation dans C
+  else
+    accesses = n * n * (4 * n + 1);	// m1 + m2 + accumulation dans C
+
+  return kite::KernelCost(2 * n * n * n, sizeof(float) * accesses);
+}
 
-  for (i = 0; i < m.size(); ++i)
-    m[i] = 0;
+cl::Event enqueueMatrixMul(cl::CommandQueue& queue, const VECTOR_CLASS<cl::Event>& waitList,
+			   const MatrixMulVariant& variant, cl::Kernel& kernel,
+			   int order, const cl::Buffer& d_m1, const cl::Buffer& d_m2, const cl::Buffer& d_r)
+{
+  kernel.setArg(0, order);
+  kernel.setArg(1, order);
+  kernel.setArg(2, d_m1);
+  kernel.setArg(3, order);
+  kernel.setArg(4, order);
+  kernel.setArg(5, d_m2);
+  kernel.setArg(6, d_r);
+  if (variant.localColumn)
+    kernel.setArg(7, cl::Local(sizeof(float) * order));
+
+  return kite::enqueueKernel(queue, kernel,
+			    variant.rowPerWorkItem ? cl::NDRange(order) : cl::NDRange(order, order),
+			    variant.rowPerWorkItem ? cl::NDRange(order / 4) : cl::NullRange,
+			    &waitList, variant.kernelName, matrixMulCost(variant, order));
 }
-void printMatrix(const int size, const std::vector<float>& m)
+
+/* ========== NUMA sub-devices ========== */
+
+/**
+ * Produit C = m1.m2 (m1: rows x order, m2: order x order) rparti par blocs de lignes
+ * sur les sous-devices. Chaque sous-device possde sa file, son bloc de lignes de m1 et
+ * de C et sa propre copie de m2; tous ces buffers sont allous sans pointeur host et
+ * touchs en premier par un kernel du sous-device.
+ *
+ * Retourne la dure du produit en secondes.
+ */
+double runNumaMatrixMul(const std::vector<cl::Device>& subDevices, const kite::ProgramSource& programSource,
+			size_t rows, int order, bool* verified)
 {
+  int p;
   int r;
   int c;
+  int partCount = subDevices.size();
 
-  for (r = 0; r < size; ++r)
+  size_t begin;
+  size_t count;
+
+  std::vector<size_t> rowBegins(partCount);
+  std::vector<size_t> rowCounts(partCount);
+
+  std::vector<cl::CommandQueue> queues;
+  std::vector<cl::Buffer> d_m1;
+  std::vector<cl::Buffer> d_m2;
+  std::vector<cl::Buffer> d_r;
+
+  cl::Context context(subDevices);
+  cl::Program program = kite::buildProgram(context, subDevices, programSource);
+
+  std::vector<cl::Kernel> mulKernels;
+  std::vector<kite::Filler> fillers;
+
+  for (p = 0; p < partCount; ++p)
   {
-    for (c = 0; c < size; ++c)
-      printf("%f\t", m[r * size + c]);
+    kite::splitRange(rows, partCount, p, &begin, &count);
+    rowBegins[p] = begin;
+    rowCounts[p] = count;
+
+    queues.push_back(cl::CommandQueue(context, subDevices[p], CL_QUEUE_PROFILING_ENABLE));
+    mulKernels.push_back(cl::Kernel(program, "mmul_cij_gmem"));
+    fillers.push_back(kite::Filler(context, subDevices[p]));
+
+    d_m1.push_back(cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(float) * std::max(count, (size_t)1) * order));
+    d_m2.push_back(cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(float) * order * order));
+    d_r.push_back(cl::Buffer(context, CL_MEM_WRITE_ONLY, sizeof(float) * std::max(count, (size_t)1) * order));
+  }
+
+  // First touch des oprandes sur chaque sous-device
+  for (p = 0; p < partCount; ++p)
+  {
+    if (rowCounts[p] > 0)
+      fillers[p].identity(queues[p], d_m1[p], rowCounts[p], order, rowBegins[p]);
+
+    fillers[p].identity(queues[p], d_m2[p], order, order);
+  }
+  for (p = 0; p < partCount; ++p)
+    queues[p].finish();
+
+  util::Timer timer;
+
+  for (p = 0; p < partCount; ++p)
+  {
+    if (rowCounts[p] == 0)
+      continue;
+
+    double n = order;
+    double m = rowCounts[p];
+
+    mulKernels[p].setArg(0, (int)rowCounts[p]);
+    mulKernels[p].setArg(1, order);
+    mulKernels[p].setArg(2, d_m1[p]);
+    mulKernels[p].setArg(3, order);
+    mulKernels[p].setArg(4, order);
+    mulKernels[p].setArg(5, d_m2[p]);
+    mulKernels[p].setArg(6, d_r[p]);
+
+    kite::enqueueKernel(queues[p], mulKernels[p], cl::NDRange(rowCounts[p], order), cl::NullRange, NULL,
+			"mmul_cij_gmem[" + std::to_string(p) + "]",
+			kite::KernelCost(2 * m * n * n, sizeof(float) * m * n * (4 * n + 1)));
+  }
+  for (p = 0; p < partCount; ++p)
+    queues[p].flush();
+  for (p = 0; p < partCount; ++p)
+    queues[p].finish();
+
+  double seconds = timer.getTimeMicroseconds() * 1e-6;
+
+  // Vrification bloc par bloc: C = m1
+  *verified = true;
+  for (p = 0; p < partCount && *verified; ++p)
+  {
+    std::vector<float> h_r(rowCounts[p] * order);
+
+    if (rowCounts[p] == 0)
+      continue;
+
+    kite::enqueueRead(queues[p], d_r[p], 0, sizeof(float) * h_r.size(), &h_r[0], NULL,
+		      "Read r[" + std::to_string(p) + "]", true);
+
+    for (r = 0; r < (int)rowCounts[p] && *verified; ++r)
+      for (c = 0; c < order; ++c)
+	if (h_r[r * order + c] != (((rowBegins[p] + r) % order == (size_t)c) ? 1 : 0))
+	{
+	  *verified = false;
+	  break;
+	}
+  }
+
+  return seconds;
+}
+
+/**
+ * Mode NUMA: un sous-device et une file par noeud NUMA du premier device CPU.
+ * 'scaling' vaut NULL (une excution sur tous les sous-devices), "strong" ou "weak".
+ */
+int runNumaMode(const std::vector<cl::Device>& devices, int order, const char* scaling)
+{
+  bool verified;
+  double seconds;
+
+  cl::Device cpuDevice;
+  std::vector<cl::Device> subDevices;
+
+  if (!kite::findCpuDevice(devices, &cpuDevice))
+  {
+    fprintf(stderr, "Mode NUMA: aucun device CPU dans le contexte\r\n");
+    return EXIT_FAILURE;
+  }
+
+  subDevices = kite::createNumaSubDevices(cpuDevice);
+  kite::printSubDevices(subDevices);
+
+  if (scaling != NULL)
+  {
+    verified = true;
+    kite::runScaling(subDevices, order, strcmp(scaling, "weak") == 0,
+		     [&](const std::vector<cl::Device>& parts, size_t rows)
+		     {
+		       bool partVerified;
+		       double partSeconds = runNumaMatrixMul(parts, mmulProgram, rows, order, &partVerified);
+
+		       verified = verified && partVerified;
+		       return partSeconds;
+		     });
+  }
+  else
+  {
+    printf("---------- C(i,j) p/ work item, %lu sous-device(s) NUMA ----------\r\n", subDevices.size());
+    printf("\r\n");
+
+    seconds = runNumaMatrixMul(subDevices, mmulProgram, order, order, &verified);
+    printf("Execute en %.0f us\r\n", seconds * 1e6);
     printf("\r\n");
   }
+
+  printf("Resultat: %s\r\n", verified ? "OK" : "ERREUR");
+  printf("\r\n");
+
+  kite::Counters::instance().printReport();
+  kite::Trace::instance().write();
+
+  return verified ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
-/* ========== Kernel executions ========== */
+/* ========== Matrix-vector products ========== */
 
-int main(int argc, char **argv)
+const int gemvRows = 4;			// GEMV_ROWS (mmul.cl)
+const int gemvBatch = 4;		// GEMV_BATCH (mmul.cl)
+const int gemvLocalSize = 64;		// Puissance de 2, >= gemvRows x gemvBatch
+const int gemvTransposedColumns = 16;	// Colonnes p/ work group de mmul_gemv_t (gemvLocalSize / 16 tranches de lignes)
+
+size_t roundUp(size_t n, size_t multiple)
 {
-  printAllPlaformInfo();
+  return (n + multiple - 1) / multiple * multiple;
+}
 
-  // Context
-  fprintf(stderr, "Initialisation du contexte OpenCL... ");
+/**
+ * r = m.v (m: rows x cols), ou r = transpose(m).v si 'transposed'. 'kernel' est
+ * mmul_gemv_n ou mmul_gemv_t.
+ */
+cl::Event enqueueGemv(cl::CommandQueue& queue, cl::Kernel& kernel, bool transposed, int rows, int cols,
+		      const cl::Buffer& d_m, const cl::Buffer& d_v, const cl::Buffer& d_r,
+		      const VECTOR_CLASS<cl::Event>* waitList = NULL)
+{
+  double m = rows;
+  double n = cols;
+
+  kernel.setArg(0, rows);
+  kernel.setArg(1, cols);
+  kernel.setArg(2, d_m);
+  kernel.setArg(3, d_v);
+  kernel.setArg(4, d_r);
+  kernel.setArg(5, cl::Local(sizeof(float) * gemvLocalSize * (transposed ? 1 : gemvRows)));
+
+  if (transposed)
+    return kite::enqueueKernel(queue, kernel,
+			       cl::NDRange(roundUp(cols, gemvTransposedColumns), gemvLocalSize / gemvTransposedColumns),
+			       cl::NDRange(gemvTransposedColumns, gemvLocalSize / gemvTransposedColumns),
+			       waitList, "mmul_gemv_t", kite::KernelCost(2 * m * n, sizeof(float) * (m * n + m + n)));
+
+  return kite::enqueueKernel(queue, kernel, cl::NDRange((rows + gemvRows - 1) / gemvRows * gemvLocalSize),
+			     cl::NDRange(gemvLocalSize), waitList, "mmul_gemv_n",
+			     kite::KernelCost(2 * m * n, sizeof(float) * (m * n + n + m)));
+}
 
-  cl::Context context(CL_DEVICE_TYPE_ALL);
-  VECTOR_CLASS<cl::Device> devices;
+/**
+ * r_b = m.v_b pour 'batchCount' vecteurs contigus (d_v: batchCount x cols, d_r:
+ * batchCount x rows). m est lue une fois p/ bloc de gemvBatch vecteurs.
+ */
+cl::Event enqueueGemvBatched(cl::CommandQueue& queue, cl::Kernel& kernel, int rows, int cols, int batchCount,
+			     const cl::Buffer& d_m, const cl::Buffer& d_v, const cl::Buffer& d_r,
+			     bool absolute = false, const VECTOR_CLASS<cl::Event>* waitList = NULL)
+{
+  double m = rows;
+  double n = cols;
+  double b = batchCount;
+  double matrixReads = (batchCount + gemvBatch - 1) / gemvBatch;
+
+  kernel.setArg(0, rows);
+  kernel.setArg(1, cols);
+  kernel.setArg(2, d_m);
+  kernel.setArg(3, batchCount);
+  kernel.setArg(4, d_v);
+  kernel.setArg(5, d_r);
+  kernel.setArg(6, cl::Local(sizeof(float) * gemvLocalSize * gemvRows * gemvBatch));
+  kernel.setArg(7, (int)absolute);
+
+  return kite::enqueueKernel(queue, kernel,
+			     cl::NDRange((rows + gemvRows - 1) / gemvRows * gemvLocalSize, (batchCount + gemvBatch - 1) / gemvBatch),
+			     cl::NDRange(gemvLocalSize, 1), waitList, absolute ? "mmul_gemv_batched (abs)" : "mmul_gemv_batched",
+			     kite::KernelCost(2 * m * n * b, sizeof(float) * (matrixReads * m * n + b * n + b * m)));
+}
 
-  if (context.getInfo<VECTOR_CLASS<cl::Device> >(CL_CONTEXT_DEVICES, &devices) != CL_SUCCESS)
+/**
+ * Mode GEMV: m.v, transpose(m).v et m.V (V: 'batchCount' vecteurs) avec m d'ordre
+ * 'order', compars au GEMM mmul_cij_gmem utilis avec 1 colonne. Les dbits atteints
+ * sont dans le rapport des compteurs; les rsultats sont vrifis sur l'hte.
+ */
+int runGemvMode(const cl::Context& context, const cl::Device& device, const cl::Program& program,
+		int order, int batchCount, int iterations)
+{
+  int i;
+  int j;
+  int b;
+  int it;
+  bool verified = true;
+
+  double n = order;
+  size_t matrixSize = (size_t)order * order;
+
+  std::vector<float> h_m(matrixSize);
+  std::vector<float> h_v((size_t)batchCount * order);
+  std::vector<float> h_r(order);
+  std::vector<float> h_rt(order);
+  std::vector<float> h_rb((size_t)batchCount * order);
+  std::vector<double> reference(order);
+
+  cl::CommandQueue queue(context, device, CL_QUEUE_PROFILING_ENABLE);
+
+  cl::Buffer d_m(context, CL_MEM_READ_WRITE, sizeof(float) * matrixSize);
+  cl::Buffer d_v(context, CL_MEM_READ_WRITE, sizeof(float) * h_v.size());
+  cl::Buffer d_r(context, CL_MEM_READ_WRITE, sizeof(float) * order);
+  cl::Buffer d_rt(context, CL_MEM_READ_WRITE, sizeof(float) * order);
+  cl::Buffer d_rb(context, CL_MEM_READ_WRITE, sizeof(float) * h_rb.size());
+
+  cl::Kernel gemmKernel(program, "mmul_cij_gmem");
+  cl::Kernel gemvKernel(program, "mmul_gemv_n");
+  cl::Kernel gemvTransposedKernel(program, "mmul_gemv_t");
+  cl::Kernel gemvBatchedKernel(program, "mmul_gemv_batched");
+
+  kite::Filler filler(context, device);
+  filler.uniform(queue, d_m, matrixSize, 1, -1, 1);
+  filler.uniform(queue, d_v, h_v.size(), 2, -1, 1);
+
+  gemmKernel.setArg(0, order);
+  gemmKernel.setArg(1, order);
+  gemmKernel.setArg(2, d_m);
+  gemmKernel.setArg(3, order);
+  gemmKernel.setArg(4, 1);
+  gemmKernel.setArg(5, d_v);
+  gemmKernel.setArg(6, d_r);
+
+  for (it = 0; it < iterations; ++it)
   {
-    fprintf(stderr, "cl::Context::getInfo() error\r\n");
-    return EXIT_FAILURE;
+    kite::enqueueKernel(queue, gemmKernel, cl::NDRange(order, 1), cl::NullRange, NULL, "mmul_cij_gmem (GEMV)",
+			kite::KernelCost(2 * n * n, sizeof(float) * n * (4 * n + 1)));
+    enqueueGemv(queue, gemvKernel, false, order, order, d_m, d_v, d_r);
+    enqueueGemv(queue, gemvTransposedKernel, true, order, order, d_m, d_v, d_rt);
+    enqueueGemvBatched(queue, gemvBatchedKernel, order, order, batchCount, d_m, d_v, d_rb);
   }
 
-  fprintf(stderr, "OK\r\n");
+  kite::enqueueRead(queue, d_m, 0, sizeof(float) * matrixSize, &h_m[0], NULL, "Read m");
+  kite::enqueueRead(queue, d_v, 0, sizeof(float) * h_v.size(), &h_v[0], NULL, "Read v");
+  kite::enqueueRead(queue, d_r, 0, sizeof(float) * order, &h_r[0], NULL, "Read r");
+  kite::enqueueRead(queue, d_rt, 0, sizeof(float) * order, &h_rt[0], NULL, "Read rt");
+  kite::enqueueRead(queue, d_rb, 0, sizeof(float) * h_rb.size(), &h_rb[0], NULL, "Read rb", true);
 
-  fprintf(stderr, "\r\n");
-  for (int i = 0; i < devices.size(); ++i)
   {
-    fprintf(stderr, "--------------- Context Device[%d] ---------------\r\n", i);
-    printDeviceInfo(devices[i]);
+    kite::TraceSpan span("Verification GEMV");
+
+    // Tolrance relative  la somme des valeurs absolues des termes (|m| <= 1, |v| <= 1)
+    for (b = 0; b < batchCount && verified; ++b)
+    {
+      for (i = 0; i < order; ++i)
+      {
+	reference[i] = 0;
+	for (j = 0; j < order; ++j)
+	  reference[i] += (double)h_m[(size_t)i * order + j] * h_v[(size_t)b * order + j];
+      }
+
+      for (i = 0; i < order; ++i)
+	if (fabs(h_rb[(size_t)b * order + i] - reference[i]) > 1e-5 * n
+	    || (b == 0 && fabs(h_r[i] - reference[i]) > 1e-5 * n))
+	  verified = false;
+    }
+
+    for (j = 0; j < order && verified; ++j)
+    {
+      double sum = 0;
+      for (i = 0; i < order; ++i)
+	sum += (double)h_m[(size_t)i * order + j] * h_v[i];
+
+      if (fabs(h_rt[j] - sum) > 1e-5 * n)
+	verified = false;
+    }
   }
-  fprintf(stderr, "\r\n");
 
-  // Command queue
-  const int queueDeviceId = 0;
-  fprintf(stderr, "Initialisation d'une file de commandes pour le device %d... ", queueDeviceId);
+  printf("---------- GEMV: ordre %d, %d vecteur(s) en batch, %d iteration(s) ----------\r\n", order, batchCount, iterations);
+  printf("\r\n");
+  printf("Resultat: %s\r\n", verified ? "OK" : "ERREUR");
+  printf("\r\n");
 
-  cl::CommandQueue queue(context, devices[queueDeviceId]);
+  kite::Counters::instance().printReport();
+  kite::Trace::instance().write();
 
-  fprintf(stderr, "OK\r\n");
-  fprintf(stderr, "\r\n");
+  return verified ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
-  // Program build
-  const std::string programFile = "mmul.cl";
-  fprintf(stderr, "Chargement du programme '%s'... ", programFile.c_str());
+/* ========== Freivalds verification ========== */
+
+/**
+ * Vrification probabiliste de C = A.B (A: m x k, B: k x n) sans relire C: pour des
+ * vecteurs alatoires r, A.(B.r) et C.r sont calculs sur le device, et seuls ces
+ * vecteurs de m rels sont relus et compars. Chaque tour divise au moins par 2 la
+ * probabilit qu'un rsultat faux soit accept. Tous les tours sont faits ensemble par
+ * des GEMV batchs: A, B et C ne sont lues qu'une fois p/ gemvBatch tours, et les
+ * vecteurs alatoires sont gnrs sur le device.
+ *
+ * La tolrance de chaque case est la borne d'erreur d'arrondi des produits en float:
+ * eps.((2k + n).(|A|.|B|.|r|) + n.(|C|.|r|)), calcule par les mmes GEMV sur les
+ * valeurs absolues. Elle suit donc les dimensions et l'ordre de grandeur des sommes.
+ */
+bool freivaldsVerify(const cl::Context& context, cl::CommandQueue& queue, const cl::Program& program,
+		     kite::Filler& filler, int m, int k, int n, const cl::Buffer& d_a, const cl::Buffer& d_b, const cl::Buffer& d_c,
+		     int rounds)
+{
+  int i;
 
-  cl::Program program;
-  try
+  float tolerance;
+
+  std::vector<float> h_abv((size_t)m * rounds);
+  std::vector<float> h_cv((size_t)m * rounds);
+  std::vector<float> h_abvAbs((size_t)m * rounds);
+  std::vector<float> h_cvAbs((size_t)m * rounds);
+
+  cl::Buffer d_v(context, CL_MEM_READ_WRITE, sizeof(float) * n * rounds);
+  cl::Buffer d_bv(context, CL_MEM_READ_WRITE, sizeof(float) * k * rounds);
+  cl::Buffer d_abv(context, CL_MEM_WRITE_ONLY, sizeof(float) * m * rounds);
+  cl::Buffer d_cv(context, CL_MEM_WRITE_ONLY, sizeof(float) * m * rounds);
+  cl::Buffer d_bvAbs(context, CL_MEM_READ_WRITE, sizeof(float) * k * rounds);
+  cl::Buffer d_abvAbs(context, CL_MEM_WRITE_ONLY, sizeof(float) * m * rounds);
+  cl::Buffer d_cvAbs(context, CL_MEM_WRITE_ONLY, sizeof(float) * m * rounds);
+
+  cl::Kernel kernel(program, "mmul_gemv_batched");
+
+  filler.uniform(queue, d_v, (size_t)n * rounds, std::random_device{}(), -1, 1);
+
+  enqueueGemvBatched(queue, kernel, k, n, rounds, d_b, d_v, d_bv);
+  enqueueGemvBatched(queue, kernel, m, k, rounds, d_a, d_bv, d_abv);
+  enqueueGemvBatched(queue, kernel, m, n, rounds, d_c, d_v, d_cv);
+
+  enqueueGemvBatched(queue, kernel, k, n, rounds, d_b, d_v, d_bvAbs, true);
+  enqueueGemvBatched(queue, kernel, m, k, rounds, d_a, d_bvAbs, d_abvAbs, true);
+  enqueueGemvBatched(queue, kernel, m, n, rounds, d_c, d_v, d_cvAbs, true);
+
+  kite::enqueueRead(queue, d_abv, 0, sizeof(float) * h_abv.size(), &h_abv[0], NULL, "Read A.B.r");
+  kite::enqueueRead(queue, d_cv, 0, sizeof(float) * h_cv.size(), &h_cv[0], NULL, "Read C.r");
+  kite::enqueueRead(queue, d_abvAbs, 0, sizeof(float) * h_abvAbs.size(), &h_abvAbs[0], NULL, "Read |A|.|B|.|r|");
+  kite::enqueueRead(queue, d_cvAbs, 0, sizeof(float) * h_cvAbs.size(), &h_cvAbs[0], NULL, "Read |C|.|r|", true);
+
+  kite::TraceSpan span("Comparaison Freivalds");
+
+  for (i = 0; i < (int)h_abv.size(); ++i)
   {
-    program = cl::Program(context, util::loadProgram(programFile));
-    program.build();
+    tolerance = FLT_EPSILON * ((2.0f * k + n) * h_abvAbs[i] + (float)n * h_cvAbs[i]);
+    if (fabsf(h_abv[i] - h_cv[i]) > tolerance)
+      return false;
   }
-  catch (...)
+
+  return true;
+}
+
+/* ========== GEMM epilogues ========== */
+
+enum GemmBias
+{
+  GEMM_BIAS_NONE = 0,
+  GEMM_BIAS_ROW = 1,		// 1 biais p/ ligne de C
+  GEMM_BIAS_COLUMN = 2		// 1 biais p/ colonne de C
+};
+
+enum GemmActivation
+{
+  GEMM_ACTIVATION_NONE = 0,
+  GEMM_ACTIVATION_RELU = 1,
+  GEMM_ACTIVATION_GELU = 2
+};
+
+/**
+ * C = act(alpha.A.B + beta.C + biais), voir mmul_tiled_epilogue (mmul.cl).
+ */
+struct GemmEpilogue
+{
+  GemmEpilogue() : alpha(1), beta(0), bias(GEMM_BIAS_NONE), activation(GEMM_ACTIVATION_NONE) {}
+
+  float alpha;
+  float beta;			// 0: C n'est pas relue
+  GemmBias bias;
+  GemmActivation activation;
+};
+
+const char* gemmBiasNames[] = { "aucun", "ligne", "colonne" };
+const char* gemmActivationNames[] = { "aucune", "relu", "gelu" };
+
+/**
+ * Options de compilation de la variante de mmul.cl spcialise pour 'epilogue'.
+ */
+std::string gemmEpilogueOptions(const GemmEpilogue& epilogue, int tile)
+{
+  return "-D GEMM_TILE=" + std::to_string(tile)
+    + " -D GEMM_BETA=" + (epilogue.beta != 0 ? "1" : "0")
+    + " -D GEMM_BIAS=" + std::to_string((int)epilogue.bias)
+    + " -D GEMM_ACTIVATION=" + std::to_string((int)epilogue.activation);
+}
+
+double applyGemmEpilogue(const GemmEpilogue& epilogue, double ab, double c, double bias)
+{
+  double x = epilogue.alpha * ab + epilogue.beta * c + bias;
+
+  if (epilogue.activation == GEMM_ACTIVATION_RELU)
+    x = std::max(x, 0.0);
+  else if (epilogue.activation == GEMM_ACTIVATION_GELU)
+    x = 0.5 * x * (1 + tanh(0.7978845608 * (x + 0.044715 * x * x * x)));
+
+  return x;
+}
+
+cl::Event enqueueTiledGemm(cl::CommandQueue& queue, cl::Kernel& kernel, int tile, int m, int k, int n,
+			   const cl::Buffer& d_a, const cl::Buffer& d_b, const cl::Buffer& d_c,
+			   const GemmEpilogue& epilogue, const cl::Buffer& d_bias, const std::string& name)
+{
+  double rows = m;
+  double cols = n;
+  double depth = k;
+  double epilogueReads = (epilogue.beta != 0 ? rows * cols : 0)
+    + (epilogue.bias == GEMM_BIAS_ROW ? rows : epilogue.bias == GEMM_BIAS_COLUMN ? cols : 0);
+
+  kernel.setArg(0, m);
+  kernel.setArg(1, k);
+  kernel.setArg(2, d_a);
+  kernel.setArg(3, k);
+  kernel.setArg(4, n);
+  kernel.setArg(5, d_b);
+  kernel.setArg(6, d_c);
+  kernel.setArg(7, epilogue.alpha);
+  kernel.setArg(8, epilogue.beta);
+  kernel.setArg(9, d_bias);
+
+  // Chaque tuile de A et B est lue une fois p/ work group
+  return kite::enqueueKernel(queue, kernel,
+			     cl::NDRange((n + tile - 1) / tile * tile, (m + tile - 1) / tile * tile), cl::NDRange(tile, tile),
+			     NULL, name,
+			     kite::KernelCost(2 * rows * cols * depth,
+					      sizeof(float) * (rows * depth * cols / tile + depth * cols * rows / tile
+							       + rows * cols + epilogueReads)));
+}
+
+/**
+ * Mode pilogue: C = act(alpha.A.B + beta.C + biais) sur des matrices d'ordre 'order',
+ * d'abord en une passe (pilogue fusionn, variante spcialise), puis en deux (produit
+ * seul, puis pilogue relisant le produit et C). Les 2 rsultats sont compars entre eux
+ * et, sur un chantillon de cases,  un calcul host en double.
+ */
+int runEpilogueMode(const cl::Context& context, const cl::Device& device, int order,
+		    const GemmEpilogue& epilogue, int iterations)
+{
+  int i;
+  int j;
+  int it;
+  int tile;
+  bool verified = true;
+
+  size_t maxWorkGroupSize;
+  size_t matrixSize = (size_t)order * order;
+
+  double fusedNs = 0;
+  double unfusedNs = 0;
+
+  std::vector<float> h_a(matrixSize);
+  std::vector<float> h_b(matrixSize);
+  std::vector<float> h_c(matrixSize);
+  std::vector<float> h_bias(order);
+  std::vector<float> h_fused(matrixSize);
+  std::vector<float> h_unfused(matrixSize);
+
+  device.getInfo(CL_DEVICE_MAX_WORK_GROUP_SIZE, &maxWorkGroupSize);
+  for (tile = 16; tile > 1 && (size_t)(tile * tile) > maxWorkGroupSize; tile /= 2)
+    ;
+
+  std::string mmulSourceText(mmulSource);
+  cl::Program fusedProgram = kite::ProgramCache::instance().get(context, device, mmulSourceText, gemmEpilogueOptions(epilogue, tile));
+  cl::Program plainProgram = kite::ProgramCache::instance().get(context, device, mmulSourceText, gemmEpilogueOptions(GemmEpilogue(), tile));
+
+  cl::CommandQueue queue(context, device, CL_QUEUE_PROFILING_ENABLE);
+
+  cl::Buffer d_a(context, CL_MEM_READ_WRITE, sizeof(float) * matrixSize);
+  cl::Buffer d_b(context, CL_MEM_READ_WRITE, sizeof(float) * matrixSize);
+  cl::Buffer d_bias(context, CL_MEM_READ_WRITE, sizeof(float) * order);
+  cl::Buffer d_t(context, CL_MEM_READ_WRITE, sizeof(float) * matrixSize);
+  cl::Buffer d_fused(context, CL_MEM_READ_WRITE, sizeof(float) * matrixSize);
+  cl::Buffer d_unfused(context, CL_MEM_READ_WRITE, sizeof(float) * matrixSize);
+
+  cl::Kernel fusedKernel(fusedProgram, "mmul_tiled_epilogue");
+  cl::Kernel plainKernel(plainProgram, "mmul_tiled_epilogue");
+  cl::Kernel epilogueKernel(fusedProgram, "mmul_epilogue");
+
+  kite::Filler filler(context, device);
+
+  // Oprandes reproductibles: C initiale identique (mme graine) pour les 2 versions
+  filler.uniform(queue, d_a, matrixSize, 1, -1, 1);
+  filler.uniform(queue, d_b, matrixSize, 2, -1, 1);
+  filler.uniform(queue, d_bias, order, 3, -1, 1);
+  filler.uniform(queue, d_fused, matrixSize, 4, -1, 1);
+
+  kite::enqueueRead(queue, d_a, 0, sizeof(float) * matrixSize, &h_a[0], NULL, "Read A");
+  kite::enqueueRead(queue, d_b, 0, sizeof(float) * matrixSize, &h_b[0], NULL, "Read B");
+  kite::enqueueRead(queue, d_bias, 0, sizeof(float) * order, &h_bias[0], NULL, "Read bias");
+  kite::enqueueRead(queue, d_fused, 0, sizeof(float) * matrixSize, &h_c[0], NULL, "Read C", true);
+
+  epilogueKernel.setArg(0, order);
+  epilogueKernel.setArg(1, order);
+  epilogueKernel.setArg(2, d_t);
+  epilogueKernel.setArg(3, d_unfused);
+  epilogueKernel.setArg(4, epilogue.alpha);
+  epilogueKernel.setArg(5, epilogue.beta);
+  epilogueKernel.setArg(6, d_bias);
+
+  for (it = 0; it < iterations; ++it)
   {
-    std::string log;
+    // C est modifie  chaque itration si beta != 0: elle est rgnre avant chaque produit
+    filler.uniform(queue, d_fused, matrixSize, 4, -1, 1);
+    filler.uniform(queue, d_unfused, matrixSize, 4, -1, 1);
 
-    program.getBuildInfo(devices[0], CL_PROGRAM_BUILD_LOG, &log);
+    cl::Event fused = enqueueTiledGemm(queue, fusedKernel, tile, order, order, order, d_a, d_b, d_fused,
+				       epilogue, d_bias, "mmul_tiled_epilogue (fusionne)");
 
-    fprintf(stderr, "Echec\r\n");
-    fprintf(stderr, "\r\n%s\r\n", log.c_str());
+    cl::Event product = enqueueTiledGemm(queue, plainKernel, tile, order, order, order, d_a, d_b, d_t,
+					 GemmEpilogue(), d_bias, "mmul_tiled_epilogue");
+
+    double n = order;
+    double epilogueReads = (epilogue.beta != 0 ? n * n : 0) + (epilogue.bias != GEMM_BIAS_NONE ? n : 0);
+    cl::Event separate = kite::enqueueKernel(queue, epilogueKernel, cl::NDRange(order, order), cl::NullRange, NULL,
+					     "mmul_epilogue", kite::KernelCost(0, sizeof(float) * (2 * n * n + epilogueReads)));
+    separate.wait();
+
+    fusedNs += fused.getProfilingInfo<CL_PROFILING_COMMAND_END>() - fused.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+    unfusedNs += product.getProfilingInfo<CL_PROFILING_COMMAND_END>() - product.getProfilingInfo<CL_PROFILING_COMMAND_START>()
+      + separate.getProfilingInfo<CL_PROFILING_COMMAND_END>() - separate.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+  }
+
+  kite::enqueueRead(queue, d_fused, 0, sizeof(float) * matrixSize, &h_fused[0], NULL, "Read C (fusionne)");
+  kite::enqueueRead(queue, d_unfused, 0, sizeof(float) * matrixSize, &h_unfused[0], NULL, "Read C (2 passes)", true);
+
+  {
+    kite::TraceSpan span("Verification epilogue");
+
+    for (i = 0; i < (int)matrixSize && verified; ++i)
+      if (fabsf(h_fused[i] - h_unfused[i]) > 1e-4f * std::max(1.0f, fabsf(h_unfused[i])))
+	verified = false;
 
+    // Echantillon de cases recalcules sur l'hte
+    std::mt19937 generator(5);
+    std::uniform_int_distribution<int> index(0, order - 1);
+
+    for (it = 0; it < 256 && verified; ++it)
+    {
+      int r = index(generator);
+      int c = index(generator);
+      double ab = 0;
+
+      for (j = 0; j < order; ++j)
+	ab += (double)h_a[(size_t)r * order + j] * h_b[(size_t)j * order + c];
+
+      double expected = applyGemmEpilogue(epilogue, ab, h_c[(size_t)r * order + c],
+					  epilogue.bias == GEMM_BIAS_ROW ? h_bias[r] : epilogue.bias == GEMM_BIAS_COLUMN ? h_bias[c] : 0);
+
+      if (fabs(h_fused[(size_t)r * order + c] - expected) > 1e-3 * std::max(1.0, fabs(expected)))
+	verified = false;
+    }
+  }
+
+  printf("---------- GEMM + epilogue: ordre %d, tuiles %dx%d ----------\r\n", order, tile, tile);
+  printf("\r\n");
+  printf("alpha = %g, beta = %g, biais: %s, activation: %s\r\n", epilogue.alpha, epilogue.beta,
+	 gemmBiasNames[epilogue.bias], gemmActivationNames[epilogue.activation]);
+  printf("Fusionne: %.0f us, 2 passes: %.0f us (moyennes sur %d iteration(s))\r\n",
+	 fusedNs * 1e-3 / iterations, unfusedNs * 1e-3 / iterations, iterations);
+  printf("Resultat: %s\r\n", verified ? "OK" : "ERREUR");
+  printf("\r\n");
+
+  kite::Counters::instance().printReport();
+  kite::ProgramCache::instance().printStats();
+  kite::Trace::instance().write();
+
+  return verified ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* ========== Matrix files ========== */
+
+const size_t matrixFileChunkBytes = 64 * 1024 * 1024;
+
+/**
+ * Ecrit la matrice identit d'ordre 'order' dans le fichier 'path', directement dans la
+ * projection mmoire du fichier.
+ */
+int writeIdentityFile(const char* path, int order)
+{
+  int r;
+  kite::MatrixFile file;
+
+  if (!file.create(path, order, order))
     return EXIT_FAILURE;
+
+  float* m = (float*)file.data();
+  for (r = 0; r < order; ++r)
+  {
+    memset(m + (size_t)r * order, 0, sizeof(float) * order);
+    m[(size_t)r * order + r] = 1;
   }
 
-  fprintf(stderr, "OK\r\n");
-  fprintf(stderr, "\r\n");
+  printf("Identite d'ordre %d ecrite dans '%s'\r\n", order, path);
 
-  // Kernel arguments initialization
-  const int matrixOrder = 1024;
-  const int matrixTotalSize = matrixOrder * matrixOrder;
+  return EXIT_SUCCESS;
+}
 
-  std::vector<float> h_m1(matrixTotalSize);
-  std::vector<float> h_m2(matrixTotalSize);
+/**
+ * Vrai si 'a' et 'b' dsignent le mme fichier existant (liens compris).
+ */
+bool sameFile(const char* a, const char* b)
+{
+  struct stat statusA;
+  struct stat statusB;
 
-  std::vector<float> h_r1(matrixTotalSize);
-  std::vector<float> h_r2(matrixTotalSize);
-  std::vector<float> h_r3(matrixTotalSize);
-  std::vector<float> h_r4(matrixTotalSize);
+  return stat(a, &statusA) == 0 && stat(b, &statusB) == 0
+    && statusA.st_dev == statusB.st_dev && statusA.st_ino == statusB.st_ino;
+}
 
-  setIdentity(matrixOrder, h_m1);
-  setIdentity(matrixOrder, h_m2);
+/**
+ * Vrai si une matrice float32 'rows' x 'cols' peut tre indexe en int par les kernels
+ * et tient dans une allocation de 'device'.
+ */
+bool fitsDevice(const cl::Device& device, uint64_t rows, uint64_t cols)
+{
+  cl_ulong maxAllocSize;
 
-  setNull(h_r1);
-  setNull(h_r2);
-  setNull(h_r3);
-  setNull(h_r4);
+  device.getInfo(CL_DEVICE_MAX_MEM_ALLOC_SIZE, &maxAllocSize);
 
-  cl::Buffer d_m1(context, h_m1.begin(), h_m1.end(), true);
-  cl::Buffer d_m2(context, h_m2.begin(), h_m2.end(), true);
+  return rows <= INT_MAX && cols <= INT_MAX && rows * cols <= INT_MAX
+    && sizeof(float) * rows * cols <= maxAllocSize;
+}
 
-  cl::Buffer d_r1(context, CL_MEM_READ_WRITE, sizeof(float) * matrixTotalSize);
-  cl::Buffer d_r2(context, CL_MEM_READ_WRITE, sizeof(float) * matrixTotalSize);
-  cl::Buffer d_r3(context, CL_MEM_READ_WRITE, sizeof(float) * matrixTotalSize);
-  cl::Buffer d_r4(context, CL_MEM_READ_WRITE, sizeof(float) * matrixTotalSize);
+/**
+ * Produit des matrices des fichiers 'm1Path' et 'm2Path' (float32, lignes contigus),
+ * crit dans 'outPath'. Les oprandes sont envoys par blocs depuis leur projection et
+ * le rsultat est lu par blocs directement dans celle du fichier de sortie. Si
+ * 'verifyRounds' > 0, le produit est vrifi sur le device (Freivalds).
+ */
+int runFileMode(const cl::Context& context, const cl::Device& device, const cl::Program& program,
+		kite::Filler& filler, const char* m1Path, const char* m2Path, const char* outPath, int verifyRounds)
+{
+  bool verified = true;
 
-  util::Timer timer;
+  kite::MatrixFile m1;
+  kite::MatrixFile m2;
+  kite::MatrixFile out;
 
-  std::string kernelName;
-  cl::Kernel matrixMulKernel;
+  if (!m1.open(m1Path) || !m2.open(m2Path))
+    return EXIT_FAILURE;
 
-  // ---------- Kernel #1: C(i,j) p/ work item (NxN work items), Global memory ----------
-  kernelName = "mmul_cij_gmem";
+  const kite::MatrixFileHeader& h1 = m1.header();
+  const kite::MatrixFileHeader& h2 = m2.header();
 
-  printf("---------- C(i,j) p/ work item (NxN work items), Global memory ----------\r\n");
-  printf("\r\n");
+  if (h1.dataType != kite::MATRIX_FLOAT32 || h2.dataType != kite::MATRIX_FLOAT32
+      || h1.layout != kite::MATRIX_ROW_MAJOR || h2.layout != kite::MATRIX_ROW_MAJOR)
+  {
+    fprintf(stderr, "Seules les matrices float32 en lignes contigues sont supportees\r\n");
+    return EXIT_FAILURE;
+  }
+  if (h1.cols != h2.rows)
+  {
+    fprintf(stderr, "Dimensions incompatibles: %lux%lu . %lux%lu\r\n",
+	    (unsigned long)h1.rows, (unsigned long)h1.cols, (unsigned long)h2.rows, (unsigned long)h2.cols);
+    return EXIT_FAILURE;
+  }
+
+  // mmul_cij_gmem indexe les matrices en int; chaque buffer est une seule allocation
+  if (!fitsDevice(device, h1.rows, h1.cols) || !fitsDevice(device, h2.rows, h2.cols)
+      || !fitsDevice(device, h1.rows, h2.cols))
+  {
+    fprintf(stderr, "Matrices trop grandes: %d elements au plus et une allocation device par matrice\r\n", INT_MAX);
+    return EXIT_FAILURE;
+  }
+
+  // create() tronque le fichier de sortie: il ne doit pas tre un oprande projet
+  if (sameFile(outPath, m1Path) || sameFile(outPath, m2Path))
+  {
+    fprintf(stderr, "--out ne peut pas designer --m1 ou --m2\r\n");
+    return EXIT_FAILURE;
+  }
+
+  if (!out.create(outPath, h1.rows, h2.cols))
+    return EXIT_FAILURE;
+
+  double m = h1.rows;
+  double k = h1.cols;
+  double n = h2.cols;
+
+  cl::CommandQueue queue(context, device, CL_QUEUE_PROFILING_ENABLE);
 
-  matrixMulKernel = cl::Kernel(program, kernelName.c_str());
-  printKernelInfo(matrixMulKernel, devices[0]);
+  cl::Buffer d_m1(context, CL_MEM_READ_ONLY, m1.dataBytes());
+  cl::Buffer d_m2(context, CL_MEM_READ_ONLY, m2.dataBytes());
+  cl::Buffer d_r(context, CL_MEM_READ_WRITE, out.dataBytes());
 
-  cl::make_kernel<int, int, cl::Buffer,
-		  int, int, cl::Buffer,
-		  cl::Buffer> matrixMulFunc1(matrixMulKernel);
+  cl::Kernel kernel(program, "mmul_cij_gmem");
+  kernel.setArg(0, (int)h1.rows);
+  kernel.setArg(1, (int)h1.cols);
+  kernel.setArg(2, d_m1);
+  kernel.setArg(3, (int)h2.rows);
+  kernel.setArg(4, (int)h2.cols);
+  kernel.setArg(5, d_m2);
+  kernel.setArg(6, d_r);
 
-  matrixMulFunc1(cl::EnqueueArgs(queue, cl::NDRange(matrixOrder, matrixOrder)),
-		 matrixOrder, matrixOrder, d_m1,
-		 matrixOrder, matrixOrder, d_m2,
-		 d_r1);
+  util::Timer timer;
+
+  VECTOR_CLASS<cl::Event> uploads;
+  uploads.push_back(m1.upload(queue, d_m1, matrixFileChunkBytes, "Write m1"));
+  uploads.push_back(m2.upload(queue, d_m2, matrixFileChunkBytes, "Write m2"));
 
-  timer.reset();
-  queue.finish();
+  VECTOR_CLASS<cl::Event> product(1, kite::enqueueKernel(queue, kernel, cl::NDRange(h1.rows, h2.cols), cl::NullRange, &uploads,
+							 "mmul_cij_gmem", kite::KernelCost(2 * m * n * k, sizeof(float) * m * n * (4 * k + 1))));
 
-  cl::copy(queue, d_r1, h_r1.begin(), h_r1.end());
+  out.download(queue, d_r, matrixFileChunkBytes, &product, "Read r").wait();
 
-  printf("Resultat: %s\r\n", isIdentity(matrixOrder, h_r1) ? "OK" : "ERREUR");
-  printf("Kernel '%s' execute en %lu us\r\n", kernelName.c_str(), timer.getTimeMicroseconds());
+  printf("---------- Produit de fichiers ----------\r\n");
   printf("\r\n");
+  printf("%s (%lux%lu) . %s (%lux%lu) -> %s\r\n",
+	 m1Path, (unsigned long)h1.rows, (unsigned long)h1.cols,
+	 m2Path, (unsigned long)h2.rows, (unsigned long)h2.cols, outPath);
+  printf("Execute en %lu us (transferts compris)\r\n", timer.getTimeMicroseconds());
 
-  // ---------- Kernel #2: C(i,*) p/ work item (N work items), Global memory ----------
-  kernelName = "mmul_ci_gmem";
+  if (verifyRounds > 0)
+  {
+    timer.reset();
+    verified = freivaldsVerify(context, queue, program, filler, h1.rows, h1.cols, h2.cols, d_m1, d_m2, d_r, verifyRounds);
 
-  printf("---------- C(i,*) p/ work item (N work items), Global memory ----------\r\n");
+    printf("Verification Freivalds (%d tours): %s, en %lu us\r\n", verifyRounds, verified ? "OK" : "ERREUR", timer.getTimeMicroseconds());
+  }
   printf("\r\n");
 
-  matrixMulKernel = cl::Kernel(program, kernelName.c_str());
-  printKernelInfo(matrixMulKernel, devices[0]);
+  {
+    kite::TraceSpan span("Synchronisation de " + std::string(outPath));
+    out.close();
+  }
 
-  cl::make_kernel<int, int, cl::Buffer,
-		  int, int, cl::Buffer,
-		  cl::Buffer> matrixMulFunc2(matrixMulKernel);
+  kite::Counters::instance().printReport();
+  kite::Trace::instance().write();
 
-  matrixMulFunc2(cl::EnqueueArgs(queue, cl::NDRange(matrixOrder), cl::NDRange(matrixOrder / 4)),
-		 matrixOrder, matrixOrder, d_m1,
-		 matrixOrder, matrixOrder, d_m2,
-		 d_r2);
+  return verified ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
-  timer.reset();
-  queue.finish();
+int main(int argc, char **argv)
+{
+  int i;
+  bool verbose = false;
+  bool sequential = false;
+  bool roofline = false;
+  bool numa = false;
+  const char* numaScaling = NULL;
+  const char* m1Path = NULL;
+  const char* m2Path = NULL;
+  const char* outPath = NULL;
+  const char* verifyName = "host";
+  bool freivalds = false;
+  int verifyRounds = 4;
+  int gemvBatchCount = 0;
+  const char* epilogueName = NULL;
+  const char* biasName = NULL;
+  bool epilogueOptions = false;
+  GemmEpilogue epilogue;
+
+  // --verbose: description complete des plateformes et des devices
+  // --sequential: chaque tache du graphe depend de la precedente
+  // --roofline: mesure des performances crete du device pour le rapport des compteurs
+  // --numa: produit rparti sur un sous-device par noeud NUMA du device CPU
+  // --numa-scaling strong|weak: passage  l'chelle sur 1..N sous-devices NUMA
+  // --m1 f --m2 f --out f: produit de matrices lues et crites au format .kmat
+  // --write-identity f n: crit l'identit d'ordre n au format .kmat
+  // --verify host|freivalds: vrification des rsultats relus sur l'hte (dfaut), ou
+  //   probabiliste sur le device sans relire C, --rounds k tours (dfaut 4)
+  // --gemv b: produits matrice-vecteur (simple, transpos et batch avec b vecteurs)
+  // --epilogue none|relu|gelu: GEMM avec pilogue fusionn compar  2 passes, avec
+  //   --alpha a, --beta b (dfauts 1 et 0) et --bias none|row|col
+  for (i = 1; i < argc; ++i)
+    if (strcmp(argv[i], "--verbose") == 0)
+      verbose = true;
+    else if (strcmp(argv[i], "--sequential") == 0)
+      sequential = true;
+    else if (strcmp(argv[i], "--roofline") == 0)
+      roofline = true;
+    else if (strcmp(argv[i], "--numa") == 0)
+      numa = true;
+    else if (strcmp(argv[i], "--numa-scaling") == 0 && i + 1 < argc)
+      numaScaling = argv[++i];
+    else if (strcmp(argv[i], "--m1") == 0 && i + 1 < argc)
+      m1Path = argv[++i];
+    else if (strcmp(argv[i], "--m2") == 0 && i + 1 < argc)
+      m2Path = argv[++i];
+    else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+      outPath = argv[++i];
+    else if (strcmp(argv[i], "--write-identity") == 0 && i + 2 < argc)
+      return writeIdentityFile(argv[i + 1], atoi(argv[i + 2]));
+    else if (strcmp(argv[i], "--verify") == 0 && i + 1 < argc)
+      verifyName = argv[++i];
+    else if (strcmp(argv[i], "--rounds") == 0 && i + 1 < argc)
+      verifyRounds = atoi(argv[++i]);
+    else if (strcmp(argv[i], "--gemv") == 0 && i + 1 < argc)
+      gemvBatchCount = std::max(1, atoi(argv[++i]));
+    else if (strcmp(argv[i], "--epilogue") == 0 && i + 1 < argc)
+      epilogueName = argv[++i];
+    else if (strcmp(argv[i], "--alpha") == 0 && i + 1 < argc)
+    {
+      epilogueOptions = true;
+      epilogue.alpha = atof(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--beta") == 0 && i + 1 < argc)
+    {
+      epilogueOptions = true;
+      epilogue.beta = atof(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--bias") == 0 && i + 1 < argc)
+    {
+      epilogueOptions = true;
+      biasName = argv[++i];
+    }
+
+  if ((m1Path != NULL || m2Path != NULL || outPath != NULL) && (m1Path == NULL || m2Path == NULL || outPath == NULL))
+  {
+    fprintf(stderr, "--m1, --m2 et --out doivent etre donnes ensemble\r\n");
+    return EXIT_FAILURE;
+  }
 
-  cl::copy(queue, d_r2, h_r2.begin(), h_r2.end());
+  if (numaScaling != NULL && strcmp(numaScaling, "strong") != 0 && strcmp(numaScaling, "weak") != 0)
+  {
+    fprintf(stderr, "--numa-scaling attend strong ou weak\r\n");
+    return EXIT_FAILURE;
+  }
 
-  printf("Resultat: %s\r\n", isIdentity(matrixOrder, h_r2) ? "OK" : "ERREUR");
-  printf("Kernel '%s' execute en %lu us\r\n", kernelName.c_str(), timer.getTimeMicroseconds());
-  printf("\r\n");
+  if (strcmp(verifyName, "host") != 0 && strcmp(verifyName, "freivalds") != 0)
+  {
+    fprintf(stderr, "--verify attend host ou freivalds\r\n");
+    return EXIT_FAILURE;
+  }
+  freivalds = strcmp(verifyName, "freivalds") == 0;
 
-  // ---------- Kernel #3: C(i,*) p/ work item (N work items), Row in private memory ----------
-  kernelName = "mmul_ci_pmemr_gmemc";
+  if (verifyRounds < 1)
+  {
+    fprintf(stderr, "--rounds doit etre au moins 1\r\n");
+    return EXIT_FAILURE;
+  }
 
-  printf("---------- C(i,*) p/ work item (N work items), Row in private memory ----------\r\n");
-  printf("\r\n");
+  if (epilogueOptions && epilogueName == NULL)
+  {
+    fprintf(stderr, "--alpha, --beta et --bias demandent --epilogue none|relu|gelu\r\n");
+    return EXIT_FAILURE;
+  }
 
-  matrixMulKernel = cl::Kernel(program, kernelName.c_str());
-  printKernelInfo(matrixMulKernel, devices[0]);
+  if (epilogueName != NULL)
+  {
+    if (strcmp(epilogueName, "none") == 0)
+      epilogue.activation = GEMM_ACTIVATION_NONE;
+    else if (strcmp(epilogueName, "relu") == 0)
+      epilogue.activation = GEMM_ACTIVATION_RELU;
+    else if (strcmp(epilogueName, "gelu") == 0)
+      epilogue.activation = GEMM_ACTIVATION_GELU;
+    else
+    {
+      fprintf(stderr, "--epilogue attend none, relu ou gelu\r\n");
+      return EXIT_FAILURE;
+    }
+  }
 
-  cl::make_kernel<int, int, cl::Buffer,
-		  int, int, cl::Buffer,
-		  cl::Buffer> matrixMulFunc3(matrixMulKernel);
+  if (biasName != NULL)
+  {
+    if (strcmp(biasName, "none") == 0)
+      epilogue.bias = GEMM_BIAS_NONE;
+    else if (strcmp(biasName, "row") == 0)
+      epilogue.bias = GEMM_BIAS_ROW;
+    else if (strcmp(biasName, "col") == 0)
+      epilogue.bias = GEMM_BIAS_COLUMN;
+    else
+    {
+      fprintf(stderr, "--bias attend none, row ou col\r\n");
+      return EXIT_FAILURE;
+    }
+  }
 
-  matrixMulFunc3(cl::EnqueueArgs(queue, cl::NDRange(matrixOrder), cl::NDRange(matrixOrder / 4)),
-		 matrixOrder, matrixOrder, d_m1,
-		 matrixOrder, matrixOrder, d_m2,
-		 d_r3);
+  if (verbose)
+    printAllPlaformInfo();
 
-  timer.reset();
-  queue.finish();
+  // Context
+  fprintf(stderr, "Initialisation du contexte OpenCL... ");
 
-  cl::copy(queue, d_r3, h_r3.begin(), h_r3.end());
+  cl::Context context(CL_DEVICE_TYPE_ALL);
+  VECTOR_CLASS<cl::Device> devices;
 
-  printf("Resultat: %s\r\n", isIdentity(matrixOrder, h_r3) ? "OK" : "ERREUR");
-  printf("Kernel '%s' execute en %lu us\r\n", kernelName.c_str(), timer.getTimeMicroseconds());
-  printf("\r\n");
+  if (context.getInfo<VECTOR_CLASS<cl::Device> >(CL_CONTEXT_DEVICES, &devices) != CL_SUCCESS)
+  {
+    fprintf(stderr, "cl::Context::getInfo() error\r\n");
+    return EXIT_FAILURE;
+  }
 
-  // ---------- Kernel #4: C(i,*) p/ work item (N work items), Private row, Local column ----------
-  kernelName = "mmul_ci_pmemr_lmemc";
+  fprintf(stderr, "OK\r\n");
 
-  printf("---------- C(i,*) p/ work item (N work items), Private row, Local column ----------\r\n");
-  printf("\r\n");
+  fprintf(stderr, "\r\n");
+  if (verbose)
+  {
+    for (i = 0; i < devices.size(); ++i)
+    {
+      fprintf(stderr, "--------------- Context Device[%d] ---------------\r\n", i);
+      printDeviceInfo(devices[i]);
+    }
+    fprintf(stderr, "\r\n");
+  }
 
-  matrixMulKernel = cl::Kernel(program, kernelName.c_str());
-  printKernelInfo(matrixMulKernel, devices[0]);
+  if (numa || numaScaling != NULL)
+    return runNumaMode(devices, 1024, numaScaling);
 
-  cl::make_kernel<int, int, cl::Buffer,
-		  int, int, cl::Buffer,
-		  cl::Buffer,
-		  cl::LocalSpaceArg> matrixMulFunc4(matrixMulKernel);
+  // Command queues
+  const size_t queueDeviceId = kite::selectDevice(devices);
+  fprintf(stderr, "Initialisation des files de commandes pour le device %lu... ", queueDeviceId);
 
-  cl::LocalSpaceArg localColumnBuffer = cl::Local(sizeof(float) * matrixOrder);
+  kite::TaskGraph graph(context, devices[queueDeviceId], sequential);
+
+  fprintf(stderr, "OK (%s)\r\n", graph.outOfOrder() ? "out of order" : "in order");
+  fprintf(stderr, "\r\n");
 
-  matrixMulFunc4(cl::EnqueueArgs(queue, cl::NDRange(matrixOrder), cl::NDRange(matrixOrder / 4)),
-		 matrixOrder, matrixOrder, d_m1,
-		 matrixOrder, matrixOrder, d_m2,
-		 d_r4,
-		 localColumnBuffer);
+  // Program build
+  fprintf(stderr, "Chargement du programme '%s'... ", mmulProgram.name);
 
-  timer.reset();
-  queue.finish();
+  kite::Trace& trace = kite::Trace::instance();
 
-  cl::copy(queue, d_r4, h_r4.begin(), h_r4.end());
+  cl::Program program;
+  kite::Filler filler;
+  bool programFromIL = false;
+  try
+  {
+    kite::TraceSpan span(std::string("Build ") + mmulProgram.name);
 
-  printf("Resultat: %s\r\n", isIdentity(matrixOrder, h_r4) ? "OK" : "ERREUR");
-  printf("Kernel '%s' execute en %lu us\r\n", kernelName.c_str(), timer.getTimeMicroseconds());
+    program = kite::buildProgram(context, devices, mmulProgram, "", &programFromIL);
+    filler = kite::Filler(context, devices[queueDeviceId]);
+  }
+  catch (...)
+  {
+    fprintf(stderr, "Echec\r\n");
+
+    return EXIT_FAILURE;
+  }
+
+  fprintf(stderr, "OK (%s)\r\n", programFromIL ? "SPIR-V" : "source");
+  fprintf(stderr, "\r\n");
+
+  if (m1Path != NULL)
+    return runFileMode(context, devices[queueDeviceId], program, filler, m1Path, m2Path, outPath, freivalds ? verifyRounds : 0);
+  if (gemvBatchCount > 0)
+    return runGemvMode(context, devices[queueDeviceId], program, 4096, gemvBatchCount, 10);
+  if (epilogueName != NULL)
+    return runEpilogueMode(context, devices[queueDeviceId], 1024, epilogue, 10);
+
+  // Kernel arguments initialization
+  const int matrixOrder = 1024;
+  const int matrixTotalSize = matrixOrder * matrixOrder;
+  const size_t matrixBytes = sizeof(float) * matrixTotalSize;
+
+  // Rsultats relus sur l'hte uniquement pour la vrification host; les oprandes
+  // sont gnrs directement sur le device
+  std::vector<std::vector<float> > h_r(freivalds ? 0 : matrixMulVariantCount, std::vector<float>(matrixTotalSize));
+
+  double buffersBeginUs = trace.nowUs();
+
+  // Remplis par un kernel: READ_WRITE
+  cl::Buffer d_m1(context, CL_MEM_READ_WRITE, matrixBytes);
+  cl::Buffer d_m2(context, CL_MEM_READ_WRITE, matrixBytes);
+
+  std::vector<cl::Buffer> d_r;
+  for (i = 0; i < matrixMulVariantCount; ++i)
+    d_r.push_back(cl::Buffer(context, CL_MEM_READ_WRITE, matrixBytes));
+
+  trace.recordHostSpan("Creation des buffers", "host", buffersBeginUs, trace.nowUs());
+
+  std::vector<cl::Kernel> kernels;
+  for (i = 0; i < matrixMulVariantCount; ++i)
+    kernels.push_back(cl::Kernel(program, matrixMulVariants[i].kernelName));
+
+  // Task graph: les 4 kernels ne dependent que de l'initialisation de m1 et m2, chaque
+  // lecture ne depend que de son kernel
+  std::vector<int> initTasks;
+  std::vector<int> kernelTasks;
+  std::vector<int> readTasks;
+
+  initTasks.push_back(graph.add("Init m1", "kernel",
+				[&](cl::CommandQueue& queue, const VECTOR_CLASS<cl::Event>& waitList)
+				{
+				  return filler.identity(queue, d_m1, matrixOrder, matrixOrder, 0, &waitList);
+				}));
+  initTasks.push_back(graph.add("Init m2", "kernel",
+				[&](cl::CommandQueue& queue, const VECTOR_CLASS<cl::Event>& waitList)
+				{
+				  return filler.identity(queue, d_m2, matrixOrder, matrixOrder, 0, &waitList);
+				}));
+
+  for (i = 0; i < matrixMulVariantCount; ++i)
+  {
+    kernelTasks.push_back(graph.add(matrixMulVariants[i].kernelName, "kernel",
+				    [&, i](cl::CommandQueue& queue, const VECTOR_CLASS<cl::Event>& waitList)
+				    {
+				      return enqueueMatrixMul(queue, waitList, matrixMulVariants[i], kernels[i],
+							      matrixOrder, d_m1, d_m2, d_r[i]);
+				    },
+				    initTasks));
+
+    if (freivalds)
+      continue;
+
+    readTasks.push_back(graph.add("Read r" + std::to_string(i + 1), "read",
+				  [&, i](cl::CommandQueue& queue, const VECTOR_CLASS<cl::Event>& waitList)
+				  {
+				    return kite::enqueueRead(queue, d_r[i], 0, matrixBytes, &h_r[i][0], &waitList,
+							     "Read r" + std::to_string(i + 1));
+				  },
+				  std::vector<int>(1, kernelTasks[i])));
+  }
+
+  util::Timer timer;
+
+  graph.run();
+
+  unsigned long graphTimeUs = timer.getTimeMicroseconds();
+
+  cl::CommandQueue verifyQueue;
+  if (freivalds)
+    verifyQueue = cl::CommandQueue(context, devices[queueDeviceId], CL_QUEUE_PROFILING_ENABLE);
+
+  for (i = 0; i < matrixMulVariantCount; ++i)
+  {
+    printf("---------- %s ----------\r\n", matrixMulVariants[i].description);
+    printf("\r\n");
+
+    printKernelInfo(kernels[i], devices[queueDeviceId]);
+
+    if (freivalds)
+    {
+      kite::TraceSpan span("Verification Freivalds r" + std::to_string(i + 1));
+      util::Timer verifyTimer;
+
+      bool verified = freivaldsVerify(context, verifyQueue, program, filler, matrixOrder, matrixOrder, matrixOrder,
+				      d_m1, d_m2, d_r[i], verifyRounds);
+
+      printf("Resultat: %s (Freivalds, %d tours, %lu us)\r\n", verified ? "OK" : "ERREUR", verifyRounds, verifyTimer.getTimeMicroseconds());
+    }
+    else
+    {
+      kite::TraceSpan span("Verification r" + std::to_string(i + 1));
+      printf("Resultat: %s\r\n", isIdentity(matrixOrder, h_r[i]) ? "OK" : "ERREUR");
+    }
+    printf("Kernel '%s' execute en %.0f us\r\n", matrixMulVariants[i].kernelName, graph.durationUs(kernelTasks[i]));
+    printf("\r\n");
+  }
+
+  printf("---------- Task graph ----------\r\n");
+  printf("\r\n");
+  graph.printConcurrencyReport();
+  printf("Graphe execute en %lu us\r\n", graphTimeUs);
   printf("\r\n");
 
+  if (roofline)
+    kite::Counters::instance().setDevicePeaks(kite::measureDevicePeaks(context, devices[queueDeviceId]));
+  kite::Counters::instance().printReport();
+
+  trace.write();
+
   return EXIT_SUCCESS;
 }
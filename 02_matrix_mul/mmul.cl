@@ -113,3 +113,292 @@ __kernel void mmul_ci_pmemr_lmemc(const int m1_rows, const int m1_cols, __global
       g_r[rr * m2_cols + j] += p_m1r[i] * l_c[i];
   }
 }
+
+
+/* ========== Produits matrice-vecteur (GEMV) ========== */
+
+/*
+ * Un GEMV ne fait que 2 flops par élément de m lu: il est limité par la bande passante.
+ * m est donc lue une seule fois, par accès contigus entre work items voisins, et chaque
+ * somme est répartie sur un work group puis réduite en mémoire locale.
+ *
+ * Les tailles de work group doivent être des puissances de 2.
+ */
+
+#ifndef GEMV_ROWS
+#define GEMV_ROWS 4	// lignes de m p/ work group: chaque élément de v lu sert GEMV_ROWS fois
+#endif
+#ifndef GEMV_BATCH
+#define GEMV_BATCH 4	// vecteurs p/ work group (GEMV batché): chaque élément de m lu sert GEMV_BATCH fois
+#endif
+
+/**
+ * r = m.v, 1 bloc de GEMV_ROWS lignes de m p/ work group (l_sums: GEMV_ROWS x taille du work group).
+ */
+__kernel void mmul_gemv_n(const int m_rows, const int m_cols, __global const float* g_m,
+			  __global const float* g_v, __global float* g_r, __local float* l_sums)
+{
+  int i;
+  int k;
+  int s;
+
+  int lid;	// work item dans le work group
+  int lsize;	// taille du work group
+  int row0;	// première ligne du bloc
+
+  float v;
+  float sums[GEMV_ROWS];
+
+  lid = get_local_id(0);
+  lsize = get_local_size(0);
+  row0 = get_group_id(0) * GEMV_ROWS;
+
+  for (k = 0; k < GEMV_ROWS; ++k)
+    sums[k] = 0;
+
+  for (i = lid; i < m_cols; i += lsize)
+  {
+    v = g_v[i];
+    for (k = 0; k < GEMV_ROWS; ++k)
+      if (row0 + k < m_rows)
+	sums[k] += g_m[(size_t)(row0 + k) * m_cols + i] * v;
+  }
+
+  for (k = 0; k < GEMV_ROWS; ++k)
+    l_sums[k * lsize + lid] = sums[k];
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for (s = lsize / 2; s > 0; s /= 2)
+  {
+    if (lid < s)
+      for (k = 0; k < GEMV_ROWS; ++k)
+	l_sums[k * lsize + lid] += l_sums[k * lsize + lid + s];
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  if (lid < GEMV_ROWS && row0 + lid < m_rows)
+    g_r[row0 + lid] = l_sums[lid * lsize];
+}
+
+/**
+ * r = transposée(m).v (r: m_cols éléments). Work groups 2D: la dimension 0 parcourt un
+ * bloc de colonnes de m (accès contigus), la dimension 1 répartit les lignes; les sommes
+ * partielles d'une colonne sont réduites en mémoire locale (l_sums: taille du work group).
+ */
+__kernel void mmul_gemv_t(const int m_rows, const int m_cols, __global const float* g_m,
+			  __global const float* g_v, __global float* g_r, __local float* l_sums)
+{
+  int i;
+  int s;
+
+  int rc;	// colonne de m (élément de r) à calculer
+  int lc;	// colonne dans le bloc
+  int lr;	// tranche de lignes
+  int lcols;
+  int lrows;
+
+  float sum;
+
+  rc = get_global_id(0);
+  lc = get_local_id(0);
+  lr = get_local_id(1);
+  lcols = get_local_size(0);
+  lrows = get_local_size(1);
+
+  sum = 0;
+  if (rc < m_cols)
+    for (i = lr; i < m_rows; i += lrows)
+      sum += g_m[(size_t)i * m_cols + rc] * g_v[i];
+
+  l_sums[lr * lcols + lc] = sum;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for (s = lrows / 2; s > 0; s /= 2)
+  {
+    if (lr < s)
+      l_sums[lr * lcols + lc] += l_sums[(lr + s) * lcols + lc];
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  if (lr == 0 && rc < m_cols)
+    g_r[rc] = l_sums[lc];
+}
+
+/**
+ * r_b = m.v_b pour 'batch_count' vecteurs contigus (g_v: batch_count x m_cols, g_r:
+ * batch_count x m_rows). Dimension 0: 1 bloc de GEMV_ROWS lignes p/ work group, dimension 1:
+ * 1 bloc de GEMV_BATCH vecteurs; m n'est relue qu'une fois p/ bloc de vecteurs.
+ * l_sums: GEMV_ROWS x GEMV_BATCH x taille du work group, qui doit être >= GEMV_ROWS x GEMV_BATCH.
+ * Si 'absolute' != 0, |m|.|v_b| est calculé (bornes d'erreur de la vérification de Freivalds).
+ */
+__kernel void mmul_gemv_batched(const int m_rows, const int m_cols, __global const float* g_m,
+				const int batch_count, __global const float* g_v, __global float* g_r,
+				__local float* l_sums, const int absolute)
+{
+  int i;
+  int k;
+  int b;
+  int s;
+
+  int lid;
+  int lsize;
+  int row0;	// première ligne du bloc
+  int batch0;	// premier vecteur du bloc
+
+  float v;
+  float m[GEMV_ROWS];
+  float sums[GEMV_ROWS][GEMV_BATCH];
+
+  lid = get_local_id(0);
+  lsize = get_local_size(0);
+  row0 = get_group_id(0) * GEMV_ROWS;
+  batch0 = get_group_id(1) * GEMV_BATCH;
+
+  for (k = 0; k < GEMV_ROWS; ++k)
+    for (b = 0; b < GEMV_BATCH; ++b)
+      sums[k][b] = 0;
+
+  for (i = lid; i < m_cols; i += lsize)
+  {
+    for (k = 0; k < GEMV_ROWS; ++k)
+    {
+      m[k] = (row0 + k < m_rows) ? g_m[(size_t)(row0 + k) * m_cols + i] : 0;
+      if (absolute)
+	m[k] = fabs(m[k]);
+    }
+
+    for (b = 0; b < GEMV_BATCH; ++b)
+      if (batch0 + b < batch_count)
+      {
+	v = g_v[(size_t)(batch0 + b) * m_cols + i];
+	if (absolute)
+	  v = fabs(v);
+	for (k = 0; k < GEMV_ROWS; ++k)
+	  sums[k][b] += m[k] * v;
+      }
+  }
+
+  for (k = 0; k < GEMV_ROWS; ++k)
+    for (b = 0; b < GEMV_BATCH; ++b)
+      l_sums[(k * GEMV_BATCH + b) * lsize + lid] = sums[k][b];
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for (s = lsize / 2; s > 0; s /= 2)
+  {
+    if (lid < s)
+      for (k = 0; k < GEMV_ROWS * GEMV_BATCH; ++k)
+	l_sums[k * lsize + lid] += l_sums[k * lsize + lid + s];
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  if (lid < GEMV_ROWS * GEMV_BATCH)
+  {
+    k = lid / GEMV_BATCH;
+    b = lid % GEMV_BATCH;
+
+    if (row0 + k < m_rows && batch0 + b < batch_count)
+      g_r[(size_t)(batch0 + b) * m_rows + row0 + k] = l_sums[lid * lsize];
+  }
+}
+
+/* ========== GEMM avec épilogue ========== */
+
+/*
+ * C = act(alpha.A.B [+ beta.C] [+ biais]), appliqué en registres avant l'unique écriture
+ * de C en mémoire globale. Chaque variante est spécialisée à la compilation (-D): les
+ * étapes absentes ne coûtent rien, ni en calcul ni en accès mémoire.
+ */
+
+#ifndef GEMM_TILE
+#define GEMM_TILE 16		// work groups de GEMM_TILE x GEMM_TILE
+#endif
+#ifndef GEMM_BETA
+#define GEMM_BETA 0		// 1: C est relue et ajoutée (beta.C)
+#endif
+#ifndef GEMM_BIAS
+#define GEMM_BIAS 0		// 0: aucun biais, 1: biais p/ ligne de C, 2: biais p/ colonne de C
+#endif
+#ifndef GEMM_ACTIVATION
+#define GEMM_ACTIVATION 0	// 0: aucune, 1: ReLU, 2: GELU (approximation tanh)
+#endif
+
+float gemm_epilogue(float ab, int r, int c, int cols, __global const float* g_r,
+		    const float alpha, const float beta, __global const float* g_bias)
+{
+  float x;
+
+  x = alpha * ab;
+#if GEMM_BETA
+  x += beta * g_r[(size_t)r * cols + c];
+#endif
+#if GEMM_BIAS == 1
+  x += g_bias[r];
+#elif GEMM_BIAS == 2
+  x += g_bias[c];
+#endif
+#if GEMM_ACTIVATION == 1
+  x = fmax(x, 0.0f);
+#elif GEMM_ACTIVATION == 2
+  x = 0.5f * x * (1 + tanh(0.7978845608f * (x + 0.044715f * x * x * x)));
+#endif
+
+  return x;
+}
+
+/**
+ * Produit par tuiles de GEMM_TILE x GEMM_TILE en mémoire locale, 1 case p/ work item.
+ * Dimension 0: colonnes (accès contigus à m2 et C), dimension 1: lignes. Les tailles
+ * quelconques sont gérées (NDRange arrondie au multiple de GEMM_TILE).
+ */
+__kernel void mmul_tiled_epilogue(const int m1_rows, const int m1_cols, __global const float* g_m1,
+				  const int m2_rows, const int m2_cols, __global const float* g_m2,
+				  __global float* g_r, const float alpha, const float beta, __global const float* g_bias)
+{
+  __local float l_m1[GEMM_TILE][GEMM_TILE];
+  __local float l_m2[GEMM_TILE][GEMM_TILE];
+
+  int i;
+  int t;
+
+  int rr; // ligne de la case à calculer
+  int rc; // colonne de la case à calculer
+  int lr;
+  int lc;
+
+  float sum;
+
+  rc = get_global_id(0);
+  rr = get_global_id(1);
+  lc = get_local_id(0);
+  lr = get_local_id(1);
+
+  sum = 0;
+  for (t = 0; t < m1_cols; t += GEMM_TILE)
+  {
+    l_m1[lr][lc] = (rr < m1_rows && t + lc < m1_cols) ? g_m1[(size_t)rr * m1_cols + t + lc] : 0;
+    l_m2[lr][lc] = (t + lr < m2_rows && rc < m2_cols) ? g_m2[(size_t)(t + lr) * m2_cols + rc] : 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (i = 0; i < GEMM_TILE; ++i)
+      sum += l_m1[lr][i] * l_m2[i][lc];
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  if (rr < m1_rows && rc < m2_cols)
+    g_r[(size_t)rr * m2_cols + rc] = gemm_epilogue(sum, rr, rc, m2_cols, g_r, alpha, beta, g_bias);
+}
+
+/**
+ * Epilogue seul, en passe séparée sur le produit g_t déjà calculé (référence non fusionnée).
+ */
+__kernel void mmul_epilogue(const int rows, const int cols, __global const float* g_t,
+			    __global float* g_r, const float alpha, const float beta, __global const float* g_bias)
+{
+  int rr;
+  int rc;
+
+  rc = get_global_id(0);
+  rr = get_global_id(1);
+
+  g_r[(size_t)rr * cols + rc] = gemm_epilogue(g_t[(size_t)rr * cols + rc], rr, rc, cols, g_r, alpha, beta, g_bias);
+}
\ No newline at end of file
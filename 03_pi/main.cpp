@@ -2,9 +2,28 @@
 
 #include <cl.hpp>
 #include <util.hpp>
+#include <trace.hpp>
+#include <program.hpp>
+#include <counters.hpp>
+#include <deviceselect.hpp>
 
 #include <vector>
 #include <string>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+/* ========== Kernels embarqués (voir Makefile) ========== */
+
+static const char piSource[] =
+#include "pi.cl.inc"
+  ;
+static const unsigned char piSpirv[] = {
+#include "pi.spv.inc"
+  0 };
+
+const kite::ProgramSource piProgram = { "pi.cl", piSource, piSpirv, sizeof(piSpirv) - 1 };
 
 /* ========== OpenCL ========== */
 
@@ -103,8 +122,6 @@ void printKernelInfo(const cl::Kernel& kernel, const cl::Device& device)
 
 /* ========== Application ========== */
 
-#define OPENCL_DEVICE_ID	0
-#define PROGRAM_FILENAME	"pi.cl"
 #define INTEGRAL_SUBDIV_COUNT	2048
 
 void computePiWithOneWIPerIteration(const cl::Context& context,
@@ -120,6 +137,8 @@ void computePiWithOneWIPerIteration(const cl::Context& context,
   int i;
   float pi;
 
+  cl::Event event;
+
   util::Timer timer;
 
   const int workGroupSize = 64;
@@ -137,26 +156,238 @@ void computePiWithOneWIPerIteration(const cl::Context& context,
   d_groupAreas = cl::Buffer(context, CL_MEM_WRITE_ONLY, sizeof(float) * workGroupCount);
 
   cl::make_kernel<cl::LocalSpaceArg, cl::Buffer> kernelFunc(kernel);
-  kernelFunc(cl::EnqueueArgs(queue, cl::NDRange(INTEGRAL_SUBDIV_COUNT), cl::NDRange(workGroupSize)),
-	     cl::Local(sizeof(float) * workGroupSize),
-	     d_groupAreas);
+  event = kernelFunc(cl::EnqueueArgs(queue, cl::NDRange(INTEGRAL_SUBDIV_COUNT), cl::NDRange(workGroupSize)),
+		     cl::Local(sizeof(float) * workGroupSize),
+		     d_groupAreas);
+  // 5 flops p/ point d'intégration + 1 addition pour la somme du work group
+  kite::recordLaunch(queue, event, "pi_1wi_1iteration",
+		     kite::KernelCost(6.0 * INTEGRAL_SUBDIV_COUNT, sizeof(float) * workGroupCount));
 
   timer.reset();
 
   queue.finish();
-  cl::copy(queue, d_groupAreas, h_groupAreas.begin(), h_groupAreas.end());
+  kite::enqueueRead(queue, d_groupAreas, 0, sizeof(float) * workGroupCount, &h_groupAreas[0], NULL, "Read groupAreas", true);
 
-  pi = 0;
-  for (i = 0; i < workGroupCount; ++i)
-    pi += h_groupAreas[i];
+  {
+    kite::TraceSpan span("Somme des aires");
+
+    pi = 0;
+    for (i = 0; i < workGroupCount; ++i)
+      pi += h_groupAreas[i];
+  }
 
   printf("\r\n");
   printf("Résultat: %.10f\r\n", pi);
   printf("Execute en %lu us\r\n", timer.getTimeMicroseconds());
 }
 
-int main(int, char**)
+/* ========== Modes de précision ========== */
+
+enum PiMode
+{
+  PI_FLOAT,
+  PI_KAHAN,
+  PI_PAIRWISE,
+  PI_DOUBLE
+};
+
+struct PiModeInfo
+{
+  const char* name;
+  const char* options;		// Options de compilation du programme
+  double flopsPerSample;	// 5 flops p/ point d'intégration + accumulation
+};
+
+const PiModeInfo piModes[] =
+{
+  { "float", "-D PI_MODE_FLOAT", 6 },
+  { "kahan", "-D PI_MODE_KAHAN", 9 },
+  { "pairwise", "-D PI_MODE_PAIRWISE", 6 },
+  { "double", "-D PI_MODE_DOUBLE", 6 }
+};
+const int piModeCount = sizeof(piModes) / sizeof(piModes[0]);
+
+struct PiResult
+{
+  double pi;
+  double kernelSeconds;
+};
+
+/**
+ * Somme host des sommes des work groups [begin, end[, avec la même méthode
+ * d'accumulation que le device.
+ */
+template <typename T>
+double sumGroupSums(int mode, const std::vector<T>& sums, size_t begin, size_t end)
+{
+  size_t i;
+  float sum;
+  float compensation;
+  double dsum;
+
+  switch (mode)
+  {
+  case PI_KAHAN:
+    sum = 0;
+    compensation = 0;
+    for (i = begin; i < end; ++i)
+    {
+      float t = sum + sums[i];
+
+      if (fabsf(sum) >= fabsf(sums[i]))
+	compensation += (sum - t) + sums[i];
+      else
+	compensation += (sums[i] - t) + sum;
+
+      sum = t;
+    }
+    return sum + compensation;
+
+  case PI_PAIRWISE:
+    if (end - begin > 8)
+      return (float)sumGroupSums(mode, sums, begin, begin + (end - begin) / 2)
+	+ (float)sumGroupSums(mode, sums, begin + (end - begin) / 2, end);
+
+    sum = 0;
+    for (i = begin; i < end; ++i)
+      sum += sums[i];
+    return sum;
+
+  case PI_DOUBLE:
+    dsum = 0;
+    for (i = begin; i < end; ++i)
+      dsum += sums[i];
+    return dsum;
+
+  default:
+    sum = 0;
+    for (i = begin; i < end; ++i)
+      sum += sums[i];
+    return sum;
+  }
+}
+
+/**
+ * Calcul de pi en 'subdivCount' subdivisions avec le mode d'accumulation 'mode',
+ * T étant le type des sommes du device (double en mode PI_DOUBLE).
+ */
+template <typename T>
+void computePiGridStride(const cl::Context& context,
+			 const cl::Device& device,
+			 cl::CommandQueue& queue,
+			 int mode,
+			 cl_ulong subdivCount,
+			 PiResult* result)
+{
+  cl::Program program;
+  cl::Kernel kernel;
+
+  std::vector<T> h_groupSums;
+  cl::Buffer d_groupSums;
+
+  cl::Event event;
+
+  cl_uint computeUnits;
+  size_t groupCount;
+
+  const size_t workGroupSize = 64;
+
+  // Les modes sont spécialisés par -D: le module SPIR-V ne peut pas servir
+  kite::ProgramSource source = piProgram;
+  source.spirv = NULL;
+  source.spirvSize = 0;
+
+  {
+    kite::TraceSpan span(std::string("Build ") + piProgram.name + " (" + piModes[mode].name + ")");
+
+    program = kite::buildProgram(context, std::vector<cl::Device>(1, device), source, piModes[mode].options);
+  }
+
+  kernel = cl::Kernel(program, "pi_grid_stride");
+
+  // Quelques work groups p/ unité de calcul, chaque work item parcourt plusieurs subdivisions
+  device.getInfo(CL_DEVICE_MAX_COMPUTE_UNITS, &computeUnits);
+  groupCount = std::min((size_t)computeUnits * 8, (size_t)((subdivCount + workGroupSize - 1) / workGroupSize));
+
+  h_groupSums.resize(groupCount);
+  d_groupSums = cl::Buffer(context, CL_MEM_WRITE_ONLY, sizeof(T) * groupCount);
+
+  cl::make_kernel<cl_ulong, cl::LocalSpaceArg, cl::LocalSpaceArg, cl::Buffer> kernelFunc(kernel);
+  event = kernelFunc(cl::EnqueueArgs(queue, cl::NDRange(groupCount * workGroupSize), cl::NDRange(workGroupSize)),
+		     subdivCount,
+		     cl::Local(sizeof(T) * workGroupSize),
+		     cl::Local(sizeof(T) * workGroupSize),
+		     d_groupSums);
+  kite::recordLaunch(queue, event, std::string("pi_grid_stride (") + piModes[mode].name + ")",
+		     kite::KernelCost(piModes[mode].flopsPerSample * subdivCount, sizeof(T) * groupCount));
+
+  kite::enqueueRead(queue, d_groupSums, 0, sizeof(T) * groupCount, &h_groupSums[0], NULL, "Read groupSums", true);
+
+  {
+    kite::TraceSpan span("Somme des aires");
+
+    result->pi = sumGroupSums(mode, h_groupSums, 0, groupCount) / subdivCount;
+  }
+  result->kernelSeconds = (event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-9;
+}
+
+/**
+ * Exécute les modes demandés ('modeName' ou "all") et affiche pour chacun l'erreur
+ * absolue par rapport à M_PI et le débit en échantillons par seconde.
+ */
+bool computePiWithPrecisionModes(const cl::Context& context,
+				 const cl::Device& device,
+				 cl::CommandQueue& queue,
+				 const char* modeName,
+				 cl_ulong subdivCount)
 {
+  int mode;
+  bool found;
+  PiResult result;
+
+  printf("\r\n");
+  printf("--------------- Kernel #2: grid stride, %llu subdivisions ---------------\r\n", (unsigned long long)subdivCount);
+  printf("\r\n");
+  printf("%-10s %16s %12s %12s %16s\r\n", "Mode", "Resultat", "Erreur", "Temps (us)", "Echantillons/s");
+
+  found = false;
+  for (mode = 0; mode < piModeCount; ++mode)
+  {
+    if (strcmp(modeName, "all") != 0 && strcmp(modeName, piModes[mode].name) != 0)
+      continue;
+
+    found = true;
+
+    if (mode == PI_DOUBLE && !kite::supportsExtension(device, "cl_khr_fp64"))
+    {
+      printf("%-10s %16s\r\n", piModes[mode].name, "(pas de cl_khr_fp64)");
+      continue;
+    }
+
+    if (mode == PI_DOUBLE)
+      computePiGridStride<double>(context, device, queue, mode, subdivCount, &result);
+    else
+      computePiGridStride<float>(context, device, queue, mode, subdivCount, &result);
+
+    printf("%-10s %16.12f %12.3e %12.0f %16.3e\r\n", piModes[mode].name, result.pi, fabs(result.pi - M_PI),
+	   result.kernelSeconds * 1e6, subdivCount / result.kernelSeconds);
+  }
+
+  if (!found)
+    fprintf(stderr, "Mode inconnu: '%s' (float, kahan, pairwise, double ou all)\r\n", modeName);
+
+  return found;
+}
+
+int main(int argc, char** argv)
+{
+  int i;
+  bool roofline;
+  bool verbose;
+  size_t deviceId;
+  const char* modeName;
+  cl_ulong subdivCount;
+
   cl::Context context;
 
   std::vector<cl::Device> devices;
@@ -167,6 +398,30 @@ int main(int, char**)
 
   util::Timer timer;
 
+  // --verbose: description complete des devices du contexte
+  // --roofline: mesure des performances crete du device pour le rapport des compteurs
+  // --mode float|kahan|pairwise|double|all: mode(s) d'accumulation du kernel grid stride
+  // --subdivs n: nombre de subdivisions du kernel grid stride
+  roofline = false;
+  verbose = false;
+  modeName = "all";
+  subdivCount = 1 << 24;
+  for (i = 1; i < argc; ++i)
+    if (strcmp(argv[i], "--roofline") == 0)
+      roofline = true;
+    else if (strcmp(argv[i], "--verbose") == 0)
+      verbose = true;
+    else if (strcmp(argv[i], "--mode") == 0 && i + 1 < argc)
+      modeName = argv[++i];
+    else if (strcmp(argv[i], "--subdivs") == 0 && i + 1 < argc)
+      subdivCount = strtoull(argv[++i], NULL, 10);
+
+  if (subdivCount < 1)
+  {
+    fprintf(stderr, "--subdivs doit être au moins 1\r\n");
+    return EXIT_FAILURE;
+  }
+
   // Contexte
   printf("Initialisation du contexte OpenCL... ");
 
@@ -177,36 +432,38 @@ int main(int, char**)
 
   getContextDevices(context, devices);
 
-  printDevicesInfo(devices);
-  printf("\r\n");
+  if (verbose)
+  {
+    printDevicesInfo(devices);
+    printf("\r\n");
+  }
 
-  targetDevice = devices[OPENCL_DEVICE_ID];
+  deviceId = kite::selectDevice(devices);
+  targetDevice = devices[deviceId];
 
   // File de commandes
-  printf("Initialisation d'une file de commandes pour le device [%d]... ", OPENCL_DEVICE_ID);
+  printf("Initialisation d'une file de commandes pour le device [%lu]... ", deviceId);
 
-  queue = cl::CommandQueue(context, targetDevice);
+  queue = cl::CommandQueue(context, targetDevice, CL_QUEUE_PROFILING_ENABLE);
 
   printf("OK\r\n");
 
   // Programme
   try
   {
-    printf("Chargement du programme '%s'... ", PROGRAM_FILENAME);
+    bool programFromIL;
+
+    printf("Chargement du programme '%s'... ", piProgram.name);
 
-    program = cl::Program(context, util::loadProgram(PROGRAM_FILENAME));
-    program.build();
+    kite::TraceSpan span(std::string("Build ") + piProgram.name);
 
-    printf("OK\r\n");
+    program = kite::buildProgram(context, std::vector<cl::Device>(1, targetDevice), piProgram, "", &programFromIL);
+
+    printf("OK (%s)\r\n", programFromIL ? "SPIR-V" : "source");
   }
   catch (cl::Error e)
   {
-    std::string log;
-
-    program.getBuildInfo(targetDevice, CL_PROGRAM_BUILD_LOG, &log);
-
     fprintf(stderr, "Exception: %s\r\n", e.what());
-    fprintf(stderr, "\r\n%s\r\n", log.c_str());
 
     return EXIT_FAILURE;
   }
@@ -214,5 +471,24 @@ int main(int, char**)
   // Execution des kernels
   computePiWithOneWIPerIteration(context, program, targetDevice, queue);
 
+  try
+  {
+    if (!computePiWithPrecisionModes(context, targetDevice, queue, modeName, subdivCount))
+      return EXIT_FAILURE;
+  }
+  catch (const cl::Error& e)
+  {
+    fprintf(stderr, "Exception: %s\r\n", e.what());
+
+    return EXIT_FAILURE;
+  }
+
+  printf("\r\n");
+  if (roofline)
+    kite::Counters::instance().setDevicePeaks(kite::measureDevicePeaks(context, targetDevice));
+  kite::Counters::instance().printReport();
+
+  kite::Trace::instance().write();
+
   return EXIT_SUCCESS;
 }
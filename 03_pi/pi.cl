@@ -28,3 +28,151 @@ __kernel void pi_1wi_1iteration(__local float* l_itemAreas, __global float* g_gr
     g_groupAreas[get_group_id(0)] = sum * subdiv;
   }
 }
+
+/* ========== Modes de précision ========== */
+
+/*
+ * Le mode d'accumulation est choisi à la compilation du programme:
+ *   PI_MODE_FLOAT     somme float simple
+ *   PI_MODE_KAHAN     somme float compensée (Neumaier)
+ *   PI_MODE_PAIRWISE  somme float par paires (erreur en O(log n))
+ *   PI_MODE_DOUBLE    somme double (cl_khr_fp64)
+ */
+
+#if defined(PI_MODE_DOUBLE)
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double real;
+#else
+typedef float real;
+#endif
+
+#define PAIRWISE_BLOCK	32	// Nombre de termes sommés directement avant fusion par paires
+#define PAIRWISE_LEVELS	32	// Bits du compteur de blocs
+
+/**
+ * Ajoute v à (*sum, *compensation). En mode Kahan/Neumaier, l'erreur d'arrondi de
+ * l'addition est accumulée dans *compensation.
+ */
+void accumulate(real* sum, real* compensation, real v)
+{
+#if defined(PI_MODE_KAHAN)
+  real t = *sum + v;
+
+  if (fabs(*sum) >= fabs(v))
+    *compensation += (*sum - t) + v;
+  else
+    *compensation += (v - t) + *sum;
+
+  *sum = t;
+#else
+  *sum += v;
+#endif
+}
+
+/**
+ * Intégration de 4/(1+x²) sur [0,1] en 'subdiv_count' subdivisions (règle du point
+ * milieu). Chaque work item parcourt les subdivisions avec un pas égal à la taille
+ * globale ("grid stride"), puis les sommes des work items sont réduites en arbre en
+ * mémoire locale (taille de work group puissance de 2).
+ *
+ * g_groupSums reçoit la somme des hauteurs de chaque work group, à multiplier par la
+ * largeur d'une subdivision.
+ */
+__kernel void pi_grid_stride(const ulong subdiv_count,
+			     __local real* l_sums, __local real* l_compensations,
+			     __global real* g_groupSums)
+{
+  ulong i;
+  ulong gsize;
+
+  int lid;
+  int stride;
+
+  real h;
+  real hBlock;
+  real x;
+  real sum;
+  real compensation;
+
+#if defined(PI_MODE_PAIRWISE)
+  int level;
+  uint blockCount;
+  int blockTerms;
+  real block;
+  real carry;
+  real levels[PAIRWISE_LEVELS];
+#endif
+
+  lid = get_local_id(0);
+  gsize = get_global_size(0);
+
+  h = (real)1 / (real)subdiv_count;
+  hBlock = h * 65536;
+
+  sum = 0;
+  compensation = 0;
+
+#if defined(PI_MODE_PAIRWISE)
+  blockCount = 0;
+  blockTerms = 0;
+  block = 0;
+#endif
+
+  for (i = get_global_id(0); i < subdiv_count; i += gsize)
+  {
+    // i = hi.2^16 + lo, hi et lo exacts en real (float compris) jusqu'à 2^40
+    // subdivisions: arrondi en real, i ferait tomber les abscisses sur une grille
+    // grossière au-delà de 2^24 subdivisions
+    x = (real)(i >> 16) * hBlock + ((real)(i & 0xffff) + (real)0.5) * h;
+
+#if defined(PI_MODE_PAIRWISE)
+    block += 4 / (1 + x * x);
+
+    if (++blockTerms == PAIRWISE_BLOCK)
+    {
+      // Compteur binaire: le niveau l contient la somme de 2^l blocs
+      carry = block;
+      for (level = 0; (blockCount >> level) & 1; ++level)
+	carry = levels[level] + carry;
+      levels[level] = carry;
+
+      ++blockCount;
+      blockTerms = 0;
+      block = 0;
+    }
+#else
+    accumulate(&sum, &compensation, 4 / (1 + x * x));
+#endif
+  }
+
+#if defined(PI_MODE_PAIRWISE)
+  sum = block;
+  for (level = 0; level < PAIRWISE_LEVELS && (blockCount >> level) != 0; ++level)
+    if ((blockCount >> level) & 1)
+      sum += levels[level];
+#endif
+
+  l_sums[lid] = sum;
+  l_compensations[lid] = compensation;
+
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for (stride = get_local_size(0) / 2; stride > 0; stride /= 2)
+  {
+    if (lid < stride)
+    {
+      sum = l_sums[lid];
+      compensation = l_compensations[lid];
+
+      accumulate(&sum, &compensation, l_sums[lid + stride]);
+
+      l_sums[lid] = sum;
+      l_compensations[lid] = compensation + l_compensations[lid + stride];
+    }
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  if (lid == 0)
+    g_groupSums[get_group_id(0)] = l_sums[0] + l_compensations[0];
+}
@@ -0,0 +1,167 @@
+/*
+ * Moteur d'intégration numérique 1D/2D.
+ *
+ * L'intégrande est fournie par l'hôte sous forme d'expression OpenCL C en x et y,
+ * définie avant ce fichier: #define INTEGRAND(x, y) (...)
+ *
+ * INTEGRATE_DOUBLE: calculs en double (cl_khr_fp64), en float sinon.
+ */
+
+#if defined(INTEGRATE_DOUBLE)
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+typedef double real;
+typedef double2 real2;
+typedef double4 real4;
+#else
+typedef float real;
+typedef float2 real2;
+typedef float4 real4;
+#endif
+
+#ifndef INTEGRAND
+#define INTEGRAND(x, y) (4 / (1 + (x) * (x)))
+#endif
+
+real integrand(real x, real y)
+{
+  return INTEGRAND(x, y);
+}
+
+/* ========== Mode uniforme ========== */
+
+/**
+ * Règle du point milieu sur une grille de nx x ny cellules de [ax,bx] x [ay,by]
+ * (ny = 1 et y = 0 en 1D). Chaque work item parcourt les cellules avec un pas égal
+ * à la taille globale, puis les sommes sont réduites en arbre en mémoire locale
+ * (taille de work group puissance de 2).
+ *
+ * g_groupSums reçoit la somme des valeurs de chaque work group, à multiplier par
+ * l'aire d'une cellule.
+ */
+__kernel void integrate_uniform(const int dimensions,
+				const real ax, const real bx, const ulong nx,
+				const real ay, const real by, const ulong ny,
+				__local real* l_sums,
+				__global real* g_groupSums)
+{
+  ulong i;
+  ulong count;
+  ulong gsize;
+
+  int lid;
+  int stride;
+
+  real hx;
+  real hy;
+  real x;
+  real y;
+  real sum;
+
+  lid = get_local_id(0);
+  gsize = get_global_size(0);
+
+  count = nx * ny;
+  hx = (bx - ax) / nx;
+  hy = (by - ay) / ny;
+
+  sum = 0;
+  for (i = get_global_id(0); i < count; i += gsize)
+  {
+    x = ax + ((real)(i % nx) + (real)0.5) * hx;
+    y = dimensions == 2 ? ay + ((real)(i / nx) + (real)0.5) * hy : 0;
+
+    sum += integrand(x, y);
+  }
+
+  l_sums[lid] = sum;
+
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for (stride = get_local_size(0) / 2; stride > 0; stride /= 2)
+  {
+    if (lid < stride)
+      l_sums[lid] += l_sums[lid + stride];
+
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  if (lid == 0)
+    g_groupSums[get_group_id(0)] = l_sums[0];
+}
+
+/* ========== Mode adaptatif ========== */
+
+/*
+ * Gauss-Legendre à 5 points sur [-1,1].
+ */
+__constant real gaussNodes[5] = { -0.9061798459386640, -0.5384693101056831, 0, 0.5384693101056831, 0.9061798459386640 };
+__constant real gaussWeights[5] = { 0.2369268850561891, 0.4786286704993665, 0.5688888888888889, 0.4786286704993665, 0.2369268850561891 };
+
+real gauss1d(real ax, real bx, real y)
+{
+  int i;
+
+  real center = (ax + bx) / 2;
+  real half = (bx - ax) / 2;
+  real sum = 0;
+
+  for (i = 0; i < 5; ++i)
+    sum += gaussWeights[i] * integrand(center + half * gaussNodes[i], y);
+
+  return half * sum;
+}
+
+real gauss2d(real ax, real bx, real ay, real by)
+{
+  int j;
+
+  real center = (ay + by) / 2;
+  real half = (by - ay) / 2;
+  real sum = 0;
+
+  for (j = 0; j < 5; ++j)
+    sum += gaussWeights[j] * gauss1d(ax, bx, center + half * gaussNodes[j]);
+
+  return half * sum;
+}
+
+/**
+ * Estimation de l'intégrale et de son erreur sur un lot de régions, 1 région
+ * p/ work item. Région: (ax, bx, ay, by), ay et by ignorés en 1D.
+ *
+ * L'estimation "fine" somme la règle de Gauss sur les 2 moitiés (1D) ou les 4
+ * quarts (2D) de la région, l'erreur est son écart avec la règle sur la région
+ * entière. g_estimates[i] = (estimation fine, erreur estimée).
+ */
+__kernel void integrate_regions(const int dimensions,
+				__global const real4* g_regions,
+				__global real2* g_estimates)
+{
+  int i;
+
+  real4 r;
+  real mx;
+  real my;
+  real coarse;
+  real fine;
+
+  i = get_global_id(0);
+  r = g_regions[i];
+
+  mx = (r.x + r.y) / 2;
+  my = (r.z + r.w) / 2;
+
+  if (dimensions == 2)
+  {
+    coarse = gauss2d(r.x, r.y, r.z, r.w);
+    fine = gauss2d(r.x, mx, r.z, my) + gauss2d(mx, r.y, r.z, my)
+      + gauss2d(r.x, mx, my, r.w) + gauss2d(mx, r.y, my, r.w);
+  }
+  else
+  {
+    coarse = gauss1d(r.x, r.y, 0);
+    fine = gauss1d(r.x, mx, 0) + gauss1d(mx, r.y, 0);
+  }
+
+  g_estimates[i] = (real2)(fine, fabs(fine - coarse));
+}
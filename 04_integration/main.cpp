@@ -0,0 +1,407 @@
+#define __CL_ENABLE_EXCEPTIONS
+
+#include <cl.hpp>
+#include <util.hpp>
+#include <trace.hpp>
+#include <program.hpp>
+#include <programcache.hpp>
+#include <counters.hpp>
+#include <deviceselect.hpp>
+
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/* ========== Kernels embarqués (voir Makefile) ========== */
+
+static const char integrateSource[] =
+#include "integrate.cl.inc"
+  ;
+
+/* ========== Intégrandes ========== */
+
+struct Domain
+{
+  int dimensions;
+  double ax;
+  double bx;
+  double ay;		// [ay, by] ignoré en 1D
+  double by;
+};
+
+struct IntegrationResult
+{
+  double value;
+  double errorEstimate;		// Mode adaptatif uniquement
+  unsigned long regions;	// Cellules (mode uniforme) ou régions évaluées (mode adaptatif)
+  unsigned long launches;
+  double kernelSeconds;
+  bool budgetExhausted;		// Mode adaptatif: tolérance non atteinte avant --max-regions
+};
+
+/**
+ * Programme spécialisé pour l'intégrande 'expression' (expression OpenCL C en x et y),
+ * compilé une seule fois par device et par expression grâce au cache de programmes.
+ */
+cl::Program integrandProgram(const cl::Context& context, const cl::Device& device,
+			     const std::string& expression, bool useDouble)
+{
+  std::string source = "#define INTEGRAND(x, y) (" + expression + ")\n" + integrateSource;
+
+  return kite::ProgramCache::instance().get(context, device, source, useDouble ? "-D INTEGRATE_DOUBLE" : "");
+}
+
+double kernelSeconds(const cl::Event& event)
+{
+  return (event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-9;
+}
+
+/* ========== Mode uniforme ========== */
+
+/**
+ * Règle du point milieu sur 'subdivs' subdivisions par dimension. T est le type
+ * réel du device (double si le programme est compilé avec INTEGRATE_DOUBLE).
+ */
+template <typename T>
+void integrateUniform(const cl::Context& context, const cl::Device& device, cl::CommandQueue& queue,
+		      const cl::Program& program, const Domain& domain, cl_ulong subdivs,
+		      IntegrationResult* result)
+{
+  size_t i;
+  size_t groupCount;
+  cl_uint computeUnits;
+
+  cl_ulong nx;
+  cl_ulong ny;
+
+  cl::Event event;
+
+  const size_t workGroupSize = 64;
+
+  nx = subdivs;
+  ny = domain.dimensions == 2 ? subdivs : 1;
+
+  device.getInfo(CL_DEVICE_MAX_COMPUTE_UNITS, &computeUnits);
+  groupCount = std::min((size_t)computeUnits * 8, (size_t)((nx * ny + workGroupSize - 1) / workGroupSize));
+
+  std::vector<T> h_groupSums(groupCount);
+  cl::Buffer d_groupSums(context, CL_MEM_WRITE_ONLY, sizeof(T) * groupCount);
+
+  cl::Kernel kernel(program, "integrate_uniform");
+
+  cl::make_kernel<int, T, T, cl_ulong, T, T, cl_ulong, cl::LocalSpaceArg, cl::Buffer> kernelFunc(kernel);
+  event = kernelFunc(cl::EnqueueArgs(queue, cl::NDRange(groupCount * workGroupSize), cl::NDRange(workGroupSize)),
+		     domain.dimensions,
+		     (T)domain.ax, (T)domain.bx, nx,
+		     (T)domain.ay, (T)domain.by, ny,
+		     cl::Local(sizeof(T) * workGroupSize),
+		     d_groupSums);
+  kite::recordLaunch(queue, event, "integrate_uniform", kite::KernelCost(0, sizeof(T) * groupCount));
+
+  kite::enqueueRead(queue, d_groupSums, 0, sizeof(T) * groupCount, &h_groupSums[0], NULL, "Read groupSums", true);
+
+  result->value = 0;
+  for (i = 0; i < groupCount; ++i)
+    result->value += h_groupSums[i];
+
+  result->value *= (domain.bx - domain.ax) / nx;
+  if (domain.dimensions == 2)
+    result->value *= (domain.by - domain.ay) / ny;
+
+  result->errorEstimate = 0;
+  result->regions = nx * ny;
+  result->launches = 1;
+  result->kernelSeconds = kernelSeconds(event);
+  result->budgetExhausted = false;
+}
+
+/* ========== Mode adaptatif ========== */
+
+/**
+ * Découpe de la région 'r' (4 réels: ax, bx, ay, by) en 2 moitiés (1D) ou 4 quarts (2D),
+ * ajoutées à 'regions'.
+ */
+template <typename T>
+void splitRegion(int dimensions, const T* r, std::vector<T>& regions)
+{
+  T mx = (r[0] + r[1]) / 2;
+  T my = (r[2] + r[3]) / 2;
+
+  if (dimensions == 2)
+  {
+    const T children[16] = { r[0], mx, r[2], my,  mx, r[1], r[2], my,
+			     r[0], mx, my, r[3],  mx, r[1], my, r[3] };
+    regions.insert(regions.end(), children, children + 16);
+  }
+  else
+  {
+    const T children[8] = { r[0], mx, 0, 0,  mx, r[1], 0, 0 };
+    regions.insert(regions.end(), children, children + 8);
+  }
+}
+
+/**
+ * Intégration adaptative: à chaque passe, toutes les régions actives sont évaluées en
+ * un seul lancement. Une région est acceptée si son erreur estimée est inférieure à sa
+ * part de 'tolerance' (proportionnelle à sa taille), sinon elle est subdivisée pour la
+ * passe suivante. Au-delà de 'maxRegions' régions évaluées, les régions restantes sont
+ * acceptées telles quelles.
+ */
+template <typename T>
+void integrateAdaptive(const cl::Context& context, cl::CommandQueue& queue,
+		       const cl::Program& program, const Domain& domain,
+		       double tolerance, unsigned long maxRegions,
+		       IntegrationResult* result)
+{
+  size_t i;
+  size_t count;
+  size_t capacity;
+  size_t splitCount;
+  int initialSplits;
+  int s;
+  int t;
+
+  double size;
+  double domainSize;
+
+  std::vector<T> regions;
+  std::vector<T> nextRegions;
+  std::vector<T> estimates;
+  std::vector<size_t> refined;
+
+  cl::Buffer d_regions;
+  cl::Buffer d_estimates;
+  cl::Event event;
+
+  cl::Kernel kernel(program, "integrate_regions");
+
+  const int regionsPerSplit = domain.dimensions == 2 ? 4 : 2;
+
+  // Découpage initial uniforme: 16 intervalles ou 4x4 rectangles
+  initialSplits = domain.dimensions == 2 ? 4 : 16;
+  for (s = 0; s < initialSplits; ++s)
+    for (t = 0; t < (domain.dimensions == 2 ? initialSplits : 1); ++t)
+    {
+      regions.push_back(domain.ax + (domain.bx - domain.ax) * s / initialSplits);
+      regions.push_back(domain.ax + (domain.bx - domain.ax) * (s + 1) / initialSplits);
+      regions.push_back(domain.dimensions == 2 ? domain.ay + (domain.by - domain.ay) * t / initialSplits : 0);
+      regions.push_back(domain.dimensions == 2 ? domain.ay + (domain.by - domain.ay) * (t + 1) / initialSplits : 0);
+    }
+
+  domainSize = (domain.bx - domain.ax) * (domain.dimensions == 2 ? domain.by - domain.ay : 1);
+
+  result->value = 0;
+  result->errorEstimate = 0;
+  result->regions = 0;
+  result->launches = 0;
+  result->kernelSeconds = 0;
+  result->budgetExhausted = false;
+
+  capacity = 0;
+  while (!regions.empty())
+  {
+    count = regions.size() / 4;
+
+    if (count > capacity)
+    {
+      capacity = std::max(count, 2 * capacity);
+      d_regions = cl::Buffer(context, CL_MEM_READ_ONLY, 4 * sizeof(T) * capacity);
+      d_estimates = cl::Buffer(context, CL_MEM_WRITE_ONLY, 2 * sizeof(T) * capacity);
+    }
+    estimates.resize(2 * count);
+
+    kite::enqueueWrite(queue, d_regions, 0, 4 * sizeof(T) * count, &regions[0], NULL, "Write regions");
+
+    kernel.setArg(0, domain.dimensions);
+    kernel.setArg(1, d_regions);
+    kernel.setArg(2, d_estimates);
+    event = kite::enqueueKernel(queue, kernel, cl::NDRange(count), cl::NullRange, NULL, "integrate_regions",
+				kite::KernelCost(0, 6 * sizeof(T) * count));
+
+    kite::enqueueRead(queue, d_estimates, 0, 2 * sizeof(T) * count, &estimates[0], NULL, "Read estimates", true);
+
+    result->regions += count;
+    result->launches += 1;
+    result->kernelSeconds += kernelSeconds(event);
+
+    kite::TraceSpan span("Raffinement");
+
+    refined.clear();
+    for (i = 0; i < count; ++i)
+    {
+      const T* r = &regions[4 * i];
+
+      size = (r[1] - r[0]) * (domain.dimensions == 2 ? r[3] - r[2] : 1);
+
+      if (estimates[2 * i + 1] > tolerance * std::fabs(size / domainSize))
+	refined.push_back(i);
+      else
+      {
+	result->value += estimates[2 * i];
+	result->errorEstimate += estimates[2 * i + 1];
+      }
+    }
+
+    splitCount = refined.size() * regionsPerSplit;
+    if (result->regions + splitCount > maxRegions)
+    {
+      for (i = 0; i < refined.size(); ++i)
+      {
+	result->value += estimates[2 * refined[i]];
+	result->errorEstimate += estimates[2 * refined[i] + 1];
+      }
+
+      result->budgetExhausted = !refined.empty();
+      break;
+    }
+
+    nextRegions.clear();
+    for (i = 0; i < refined.size(); ++i)
+      splitRegion(domain.dimensions, &regions[4 * refined[i]], nextRegions);
+
+    regions.swap(nextRegions);
+  }
+}
+
+/* ========== Application ========== */
+
+int main(int argc, char** argv)
+{
+  int i;
+  size_t j;
+
+  bool adaptive;
+  bool forceFloat;
+  bool useDouble;
+  double tolerance;
+  unsigned long maxRegions;
+  cl_ulong subdivs;
+
+  Domain domain;
+  IntegrationResult result;
+  std::vector<std::string> expressions;
+
+  cl::Context context;
+  std::vector<cl::Device> devices;
+  cl::Device device;
+  size_t deviceId;
+  cl::CommandQueue queue;
+  std::string deviceName;
+
+  // --expr e: intégrande, expression OpenCL C en x (et y en 2D), répétable
+  // --x a b: bornes en x (défaut 0 1)
+  // --y a b: bornes en y, intégration 2D
+  // --subdivs n: subdivisions par dimension du mode uniforme
+  // --adaptive: mode adaptatif, --tol t: tolérance absolue, --max-regions n: budget de régions
+  // --float: calcul en float même si le device supporte cl_khr_fp64
+  domain.dimensions = 1;
+  domain.ax = 0;
+  domain.bx = 1;
+  domain.ay = 0;
+  domain.by = 0;
+  adaptive = false;
+  forceFloat = false;
+  tolerance = 1e-10;
+  maxRegions = 1 << 22;
+  subdivs = 0;
+  for (i = 1; i < argc; ++i)
+    if (strcmp(argv[i], "--expr") == 0 && i + 1 < argc)
+      expressions.push_back(argv[++i]);
+    else if (strcmp(argv[i], "--x") == 0 && i + 2 < argc)
+    {
+      domain.ax = atof(argv[++i]);
+      domain.bx = atof(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--y") == 0 && i + 2 < argc)
+    {
+      domain.dimensions = 2;
+      domain.ay = atof(argv[++i]);
+      domain.by = atof(argv[++i]);
+    }
+    else if (strcmp(argv[i], "--subdivs") == 0 && i + 1 < argc)
+      subdivs = strtoull(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "--adaptive") == 0)
+      adaptive = true;
+    else if (strcmp(argv[i], "--tol") == 0 && i + 1 < argc)
+      tolerance = atof(argv[++i]);
+    else if (strcmp(argv[i], "--max-regions") == 0 && i + 1 < argc)
+      maxRegions = strtoul(argv[++i], NULL, 10);
+    else if (strcmp(argv[i], "--float") == 0)
+      forceFloat = true;
+
+  if (expressions.empty())
+    expressions.push_back("4 / (1 + x * x)");
+  if (subdivs == 0)
+    subdivs = domain.dimensions == 2 ? 4096 : 1 << 24;
+
+  try
+  {
+    // Contexte, device et file de commandes
+    context = cl::Context(CL_DEVICE_TYPE_ALL);
+    context.getInfo(CL_CONTEXT_DEVICES, &devices);
+
+    deviceId = kite::selectDevice(devices);
+    device = devices[deviceId];
+    device.getInfo(CL_DEVICE_NAME, &deviceName);
+
+    queue = cl::CommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE);
+
+    useDouble = !forceFloat && kite::supportsExtension(device, "cl_khr_fp64");
+
+    printf("Device [%lu]: %s, calcul en %s\r\n", deviceId, deviceName.c_str(), useDouble ? "double" : "float");
+    printf("\r\n");
+
+    for (j = 0; j < expressions.size(); ++j)
+    {
+      printf("--------------- %s ---------------\r\n", expressions[j].c_str());
+      printf("\r\n");
+
+      util::Timer timer;
+
+      cl::Program program = integrandProgram(context, device, expressions[j], useDouble);
+
+      unsigned long buildUs = timer.getTimeMicroseconds();
+
+      timer.reset();
+
+      if (adaptive && useDouble)
+	integrateAdaptive<double>(context, queue, program, domain, tolerance, maxRegions, &result);
+      else if (adaptive)
+	integrateAdaptive<float>(context, queue, program, domain, tolerance, maxRegions, &result);
+      else if (useDouble)
+	integrateUniform<double>(context, device, queue, program, domain, subdivs, &result);
+      else
+	integrateUniform<float>(context, device, queue, program, domain, subdivs, &result);
+
+      if (domain.dimensions == 2)
+	printf("Domaine: [%g, %g] x [%g, %g]\r\n", domain.ax, domain.bx, domain.ay, domain.by);
+      else
+	printf("Domaine: [%g, %g]\r\n", domain.ax, domain.bx);
+      printf("Resultat: %.15g\r\n", result.value);
+      if (adaptive)
+	printf("Erreur estimee: %.3e%s\r\n", result.errorEstimate, result.budgetExhausted ? " (budget de regions atteint)" : "");
+      printf("%s: %lu, lancements: %lu\r\n", adaptive ? "Regions evaluees" : "Cellules", result.regions, result.launches);
+      printf("Programme obtenu en %lu us\r\n", buildUs);
+      printf("Execute en %lu us (kernels: %.0f us)\r\n", timer.getTimeMicroseconds(), result.kernelSeconds * 1e6);
+      printf("\r\n");
+    }
+  }
+  catch (const cl::Error& e)
+  {
+    fprintf(stderr, "Exception: %s (%d)\r\n", e.what(), e.err());
+
+    return EXIT_FAILURE;
+  }
+
+  kite::ProgramCache::instance().printStats();
+  printf("\r\n");
+
+  kite::Counters::instance().printReport();
+  kite::Trace::instance().write();
+
+  return EXIT_SUCCESS;
+}
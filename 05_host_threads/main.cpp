@@ -0,0 +1,296 @@
+#define __CL_ENABLE_EXCEPTIONS
+
+#include <cl.hpp>
+#include <util.hpp>
+#include <trace.hpp>
+#include <program.hpp>
+#include <counters.hpp>
+#include <submission.hpp>
+#include <deviceselect.hpp>
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/* ========== Kernels embarqués (voir Makefile) ========== */
+
+static const char vaddSource[] =
+#include "../01_vector_add/vadd.cl.inc"
+  ;
+static const char mmulSource[] =
+#include "../02_matrix_mul/mmul.cl.inc"
+  ;
+
+const kite::ProgramSource vaddProgram = { "vadd.cl", vaddSource, NULL, 0 };
+const kite::ProgramSource mmulProgram = { "mmul.cl", mmulSource, NULL, 0 };
+
+/* ========== Stress benchmark ========== */
+
+const cl_uint vaddLength = 1 << 20;
+const int gemmOrder = 256;
+
+struct StressOptions
+{
+  bool vadd;
+  bool gemm;
+  int operationsPerThread;
+};
+
+struct StressResult
+{
+  unsigned long operations;
+  double seconds;
+  std::vector<double> latenciesUs;
+};
+
+/**
+ * Buffers propres à un thread: les threads ne partagent que le contexte et les programmes.
+ */
+struct ThreadBuffers
+{
+  ThreadBuffers(const cl::Context& context)
+    : d_a(context, CL_MEM_READ_ONLY, sizeof(float) * vaddLength),
+      d_b(context, CL_MEM_READ_ONLY, sizeof(float) * vaddLength),
+      d_c(context, CL_MEM_READ_ONLY, sizeof(float) * vaddLength),
+      d_d(context, CL_MEM_WRITE_ONLY, sizeof(float) * vaddLength),
+      d_m1(context, CL_MEM_READ_ONLY, sizeof(float) * gemmOrder * gemmOrder),
+      d_m2(context, CL_MEM_READ_ONLY, sizeof(float) * gemmOrder * gemmOrder),
+      d_r(context, CL_MEM_WRITE_ONLY, sizeof(float) * gemmOrder * gemmOrder) {}
+
+  cl::Buffer d_a, d_b, d_c, d_d;
+  cl::Buffer d_m1, d_m2, d_r;
+};
+
+double percentile(const std::vector<double>& sorted, double p)
+{
+  if (sorted.empty())
+    return 0;
+
+  return sorted[std::min(sorted.size() - 1, (size_t)(p * (sorted.size() - 1) + 0.5))];
+}
+
+/**
+ * Opération 'i' d'un thread: vadd ou GEMM, en alternance si les deux sont demandés.
+ */
+bool isGemmOperation(const StressOptions& options, int i)
+{
+  return options.gemm && (!options.vadd || i % 2 == 1);
+}
+
+/**
+ * Boucle d'un thread: chaque opération est soumise dans la file du thread puis
+ * attendue; sa latence est mesurée côté host, de la soumission à la fin. Les
+ * lancements ne sont enregistrés (compteurs, trace) qu'après la boucle: leurs
+ * verrous globaux sérialiseraient sinon les threads mesurés.
+ */
+void stressThread(kite::Submitter* submitter, const cl::Program* vadd, const cl::Program* mmul,
+		  const StressOptions* options, std::atomic<bool>* start, std::vector<double>* latenciesUs)
+{
+  int i;
+
+  cl_uint computeUnits;
+
+  const kite::KernelCost gemmCost(2.0 * gemmOrder * gemmOrder * gemmOrder,
+				  sizeof(float) * gemmOrder * gemmOrder * (4.0 * gemmOrder + 1));
+  const kite::KernelCost vaddCost(2.0 * vaddLength, 4.0 * sizeof(float) * vaddLength);
+
+  std::vector<cl::Event> events(options->operationsPerThread);
+
+  try
+  {
+    // Espace de soumission libéré à la sortie du thread
+    kite::Submitter::Scope scope(*submitter);
+    cl::CommandQueue& queue = scope.worker().queue();
+
+    ThreadBuffers buffers(submitter->context());
+
+    cl::Kernel& vaddKernel = scope.worker().kernel(*vadd, "vadd_stride");
+    cl::Kernel& gemmKernel = scope.worker().kernel(*mmul, "mmul_cij_gmem");
+
+    submitter->device().getInfo(CL_DEVICE_MAX_COMPUTE_UNITS, &computeUnits);
+
+    vaddKernel.setArg(0, vaddLength);
+    vaddKernel.setArg(1, buffers.d_a);
+    vaddKernel.setArg(2, buffers.d_b);
+    vaddKernel.setArg(3, buffers.d_c);
+    vaddKernel.setArg(4, buffers.d_d);
+
+    gemmKernel.setArg(0, gemmOrder);
+    gemmKernel.setArg(1, gemmOrder);
+    gemmKernel.setArg(2, buffers.d_m1);
+    gemmKernel.setArg(3, gemmOrder);
+    gemmKernel.setArg(4, gemmOrder);
+    gemmKernel.setArg(5, buffers.d_m2);
+    gemmKernel.setArg(6, buffers.d_r);
+
+    queue.enqueueFillBuffer(buffers.d_a, 0.0f, 0, sizeof(float) * vaddLength);
+    queue.enqueueFillBuffer(buffers.d_b, 1.0f, 0, sizeof(float) * vaddLength);
+    queue.enqueueFillBuffer(buffers.d_c, -1.0f, 0, sizeof(float) * vaddLength);
+    queue.enqueueFillBuffer(buffers.d_m1, 1.0f, 0, sizeof(float) * gemmOrder * gemmOrder);
+    queue.enqueueFillBuffer(buffers.d_m2, 1.0f, 0, sizeof(float) * gemmOrder * gemmOrder);
+    queue.finish();
+
+    latenciesUs->reserve(options->operationsPerThread);
+
+    while (!start->load())
+      std::this_thread::yield();
+
+    for (i = 0; i < options->operationsPerThread; ++i)
+    {
+      std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+      if (isGemmOperation(*options, i))
+	queue.enqueueNDRangeKernel(gemmKernel, cl::NullRange, cl::NDRange(gemmOrder, gemmOrder), cl::NullRange,
+				   NULL, &events[i]);
+      else
+	queue.enqueueNDRangeKernel(vaddKernel, cl::NullRange, cl::NDRange(computeUnits * 4 * 64), cl::NDRange(64),
+				   NULL, &events[i]);
+      queue.finish();
+
+      latenciesUs->push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count());
+    }
+
+    for (i = 0; i < options->operationsPerThread; ++i)
+      if (isGemmOperation(*options, i))
+	kite::recordLaunch(queue, events[i], "mmul_cij_gmem", gemmCost);
+      else
+	kite::recordLaunch(queue, events[i], "vadd_stride", vaddCost);
+  }
+  catch (const cl::Error& e)
+  {
+    // Les opérations terminées restent comptées dans les latences
+    fprintf(stderr, "Thread de soumission: %s (%d)\r\n", e.what(), e.err());
+  }
+}
+
+/**
+ * Exécute 'threadCount' threads de soumission simultanés.
+ */
+void runStress(kite::Submitter& submitter, const cl::Program& vadd, const cl::Program& mmul,
+	       const StressOptions& options, int threadCount, StressResult* result)
+{
+  int t;
+
+  std::atomic<bool> start(false);
+  std::vector<std::thread> threads;
+  std::vector<std::vector<double> > latenciesUs(threadCount);
+
+  for (t = 0; t < threadCount; ++t)
+    threads.push_back(std::thread(stressThread, &submitter, &vadd, &mmul, &options, &start, &latenciesUs[t]));
+
+  // Les threads préparent leur file, leurs kernels et leurs buffers avant le départ
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  util::Timer timer;
+  start.store(true);
+
+  for (t = 0; t < threadCount; ++t)
+    threads[t].join();
+
+  result->seconds = timer.getTimeMicroseconds() * 1e-6;
+
+  result->latenciesUs.clear();
+  for (t = 0; t < threadCount; ++t)
+    result->latenciesUs.insert(result->latenciesUs.end(), latenciesUs[t].begin(), latenciesUs[t].end());
+  std::sort(result->latenciesUs.begin(), result->latenciesUs.end());
+
+  result->operations = result->latenciesUs.size();
+}
+
+/* ========== Application ========== */
+
+int main(int argc, char** argv)
+{
+  int i;
+  int threadCount;
+  int maxThreads;
+  size_t deviceId;
+  const char* kernelMode;
+
+  StressOptions options;
+  StressResult result;
+
+  cl::Context context;
+  std::vector<cl::Device> devices;
+  cl::Device device;
+  cl::Program vadd;
+  cl::Program mmul;
+  std::string deviceName;
+
+  // --threads n: nombre maximum de threads host (défaut: nombre de coeurs, 1, 2, 4... n)
+  // --ops n: opérations par thread
+  // --kernel vadd|gemm|both: opérations soumises
+  maxThreads = std::max(1u, std::thread::hardware_concurrency());
+  options.operationsPerThread = 200;
+  kernelMode = "both";
+  for (i = 1; i < argc; ++i)
+    if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+      maxThreads = std::max(1, atoi(argv[++i]));
+    else if (strcmp(argv[i], "--ops") == 0 && i + 1 < argc)
+      options.operationsPerThread = std::max(1, atoi(argv[++i]));
+    else if (strcmp(argv[i], "--kernel") == 0 && i + 1 < argc)
+      kernelMode = argv[++i];
+
+  if (strcmp(kernelMode, "vadd") != 0 && strcmp(kernelMode, "gemm") != 0 && strcmp(kernelMode, "both") != 0)
+  {
+    fprintf(stderr, "--kernel attend vadd, gemm ou both\r\n");
+    return EXIT_FAILURE;
+  }
+
+  options.vadd = strcmp(kernelMode, "gemm") != 0;
+  options.gemm = strcmp(kernelMode, "vadd") != 0;
+
+  try
+  {
+    context = cl::Context(CL_DEVICE_TYPE_ALL);
+    context.getInfo(CL_CONTEXT_DEVICES, &devices);
+
+    deviceId = kite::selectDevice(devices);
+    device = devices[deviceId];
+    device.getInfo(CL_DEVICE_NAME, &deviceName);
+
+    // Programmes construits une fois, partagés par tous les threads
+    vadd = kite::buildProgram(context, std::vector<cl::Device>(1, device), vaddProgram);
+    mmul = kite::buildProgram(context, std::vector<cl::Device>(1, device), mmulProgram);
+
+    kite::Submitter submitter(context, device);
+
+    printf("Device [%lu]: %s\r\n", deviceId, deviceName.c_str());
+    printf("Operations: %s, %d p/ thread (vadd: %u elements, GEMM: ordre %d)\r\n",
+	   kernelMode, options.operationsPerThread, vaddLength, gemmOrder);
+    printf("\r\n");
+
+    printf("%8s %10s %12s %12s %12s %12s %12s\r\n", "Threads", "Ops", "Ops/s", "p50 (us)", "p95 (us)", "p99 (us)", "max (us)");
+
+    for (threadCount = 1; ; threadCount = std::min(threadCount * 2, maxThreads))
+    {
+      runStress(submitter, vadd, mmul, options, threadCount, &result);
+
+      printf("%8d %10lu %12.1f %12.0f %12.0f %12.0f %12.0f\r\n", threadCount, result.operations,
+	     result.operations / result.seconds,
+	     percentile(result.latenciesUs, 0.50), percentile(result.latenciesUs, 0.95),
+	     percentile(result.latenciesUs, 0.99), result.latenciesUs.empty() ? 0 : result.latenciesUs.back());
+
+      if (threadCount == maxThreads)
+	break;
+    }
+    printf("\r\n");
+  }
+  catch (const cl::Error& e)
+  {
+    fprintf(stderr, "Exception: %s (%d)\r\n", e.what(), e.err());
+
+    return EXIT_FAILURE;
+  }
+
+  kite::Counters::instance().printReport();
+  kite::Trace::instance().write();
+
+  return EXIT_SUCCESS;
+}
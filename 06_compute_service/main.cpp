@@ -0,0 +1,1331 @@
+#define __CL_ENABLE_EXCEPTIONS
+
+#include <cl.hpp>
+#include <util.hpp>
+#include <program.hpp>
+#include <programcache.hpp>
+#include <deviceselect.hpp>
+#include <bufferpool.hpp>
+
+#include <vector>
+#include <string>
+#include <deque>
+#include <list>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+/* ========== Kernels embarqués (voir Makefile) ========== */
+
+static const char vaddSource[] =
+#include "../01_vector_add/vadd.cl.inc"
+  ;
+static const char mmulSource[] =
+#include "../02_matrix_mul/mmul.cl.inc"
+  ;
+static const char reduceSource[] =
+#include "reduce.cl.inc"
+  ;
+static const unsigned char reduceSpirv[] = {
+#include "reduce.spv.inc"
+  0 };
+
+const kite::ProgramSource vaddProgram = { "vadd.cl", vaddSource, NULL, 0 };
+const kite::ProgramSource reduceProgram = { "reduce.cl", reduceSource, reduceSpirv, sizeof(reduceSpirv) - 1 };
+
+/* ========== Protocole ========== */
+
+/*
+ * Requêtes et réponses de taille fixe sur une socket Unix locale (SOCK_STREAM), une
+ * requête en cours au plus par connexion. Les opérandes et les résultats ne passent pas
+ * par la socket: ils sont dans un objet de mémoire partagée POSIX (shm_open) créé par
+ * le client et nommé dans la requête, que le service projette à son tour et transfère
+ * directement de et vers le device.
+ *
+ * Contenu de la mémoire partagée (float32, matrices en lignes contiguës):
+ *  - JOB_VADD (n): a, b, c puis d = a + b + c, n réels chacun
+ *  - JOB_GEMM (m, k, n): A (m x k), B (k x n) puis C = A.B (m x n)
+ *  - JOB_REDUCE (n): x (n réels); la somme est renvoyée dans la réponse
+ */
+
+const uint32_t serviceMagic = 0x4b4a4f42;	// "KJOB"
+const uint64_t maxJobElements = 1ULL << 28;	// Par opérande
+
+enum JobType
+{
+  JOB_VADD = 1,
+  JOB_GEMM = 2,
+  JOB_REDUCE = 3,
+  JOB_STATS = 4,		// Réponse suivie du rapport texte des statistiques
+  JOB_SHUTDOWN = 5
+};
+
+enum JobStatus
+{
+  JOB_OK = 0,
+  JOB_BAD_REQUEST = -1,
+  JOB_BAD_SHARED_MEMORY = -2,
+  JOB_DEVICE_ERROR = -3,
+  JOB_STOPPING = -4		// Service en cours d'arrêt
+};
+
+struct JobRequest
+{
+  uint32_t magic;
+  uint32_t type;
+  uint64_t id;			// Choisi par le client, recopié dans la réponse
+  uint64_t m;
+  uint64_t k;
+  uint64_t n;
+  char sharedMemory[64];	// Nom de l'objet de mémoire partagée ("/...")
+};
+
+struct JobReply
+{
+  uint32_t magic;
+  int32_t status;
+  uint64_t id;
+  double value;			// JOB_REDUCE: somme
+  double waitUs;		// De la réception à la soumission (regroupement compris)
+  double deviceUs;		// Des premières aux dernières commandes sur le device
+  double totalUs;		// De la réception de la requête à la fin du travail
+  uint32_t textBytes;		// JOB_STATS: taille du rapport qui suit
+  uint32_t reserved;
+};
+
+const char* jobTypeNames[] = { "?", "vadd", "gemm", "reduce" };
+
+/**
+ * Taille de la mémoire partagée d'un travail, 0 si la requête est invalide.
+ */
+size_t jobSharedBytes(const JobRequest& request)
+{
+  switch (request.type)
+  {
+  case JOB_VADD:
+    return request.n > 0 && request.n <= maxJobElements ? sizeof(float) * 4 * request.n : 0;
+  case JOB_GEMM:
+    // Dimensions bornées avant tout produit, produits vérifiés par division: m, k et n
+    // sont passés en int au kernel et aucun produit ne doit déborder
+    if (request.m == 0 || request.k == 0 || request.n == 0
+	|| request.m > maxJobElements || request.k > maxJobElements || request.n > maxJobElements
+	|| request.m > maxJobElements / request.k || request.k > maxJobElements / request.n
+	|| request.m > maxJobElements / request.n)
+      return 0;
+    return sizeof(float) * (request.m * request.k + request.k * request.n + request.m * request.n);
+  case JOB_REDUCE:
+    return request.n > 0 && request.n <= maxJobElements ? sizeof(float) * request.n : 0;
+  default:
+    return 0;
+  }
+}
+
+bool readFully(int fd, void* data, size_t size)
+{
+  ssize_t count;
+  char* p = (char*)data;
+
+  while (size > 0)
+  {
+    count = read(fd, p, size);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count <= 0)
+      return false;
+
+    p += count;
+    size -= count;
+  }
+
+  return true;
+}
+
+bool writeFully(int fd, const void* data, size_t size)
+{
+  ssize_t count;
+  const char* p = (const char*)data;
+
+  while (size > 0)
+  {
+    count = write(fd, p, size);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count <= 0)
+      return false;
+
+    p += count;
+    size -= count;
+  }
+
+  return true;
+}
+
+std::string defaultSocketPath()
+{
+  return "/tmp/kite-compute-" + std::to_string(getuid()) + ".sock";
+}
+
+int connectService(const std::string& path)
+{
+  int fd;
+  struct sockaddr_un address;
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+
+  if (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0)
+  {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/* ========== Mémoire partagée ========== */
+
+/**
+ * Objet de mémoire partagée POSIX projeté en lecture/écriture. Celui qui le crée le
+ * supprime à sa fermeture.
+ */
+class SharedMemory
+{
+public:
+
+  SharedMemory() : _data(NULL), _bytes(0), _owner(false) {}
+  ~SharedMemory() { close(); }
+
+  bool create(const std::string& name, size_t bytes)
+  {
+    int fd;
+
+    fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+    {
+      perror(name.c_str());
+      return false;
+    }
+
+    _name = name;
+    _owner = true;
+
+    if (ftruncate(fd, bytes) != 0)
+    {
+      perror(name.c_str());
+      ::close(fd);
+      close();
+      return false;
+    }
+
+    return map(fd, bytes);
+  }
+
+  /**
+   * Projette l'objet 'name', qui doit contenir au moins 'bytes' octets.
+   */
+  bool open(const std::string& name, size_t bytes)
+  {
+    int fd;
+    struct stat status;
+
+    fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0)
+      return false;
+
+    if (fstat(fd, &status) != 0 || (size_t)status.st_size < bytes)
+    {
+      ::close(fd);
+      return false;
+    }
+
+    _name = name;
+
+    return map(fd, bytes);
+  }
+
+  void close()
+  {
+    if (_data != NULL)
+      munmap(_data, _bytes);
+    if (_owner)
+      shm_unlink(_name.c_str());
+
+    _data = NULL;
+    _bytes = 0;
+    _owner = false;
+  }
+
+  float* data() const { return (float*)_data; }
+
+private:
+
+  SharedMemory(const SharedMemory&);
+  SharedMemory& operator=(const SharedMemory&);
+
+  bool map(int fd, size_t bytes)
+  {
+    _data = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+
+    if (_data == MAP_FAILED)
+    {
+      _data = NULL;
+      close();
+      return false;
+    }
+
+    _bytes = bytes;
+
+    return true;
+  }
+
+  std::string _name;
+  void* _data;
+  size_t _bytes;
+  bool _owner;
+};
+
+/* ========== Service ========== */
+
+const int vaddLocalSize = 64;
+const int reduceLocalSize = 64;
+
+double percentile(const std::vector<double>& sorted, double p)
+{
+  if (sorted.empty())
+    return 0;
+
+  return sorted[std::min(sorted.size() - 1, (size_t)(p * (sorted.size() - 1) + 0.5))];
+}
+
+// Plus grand travail regroupé avec d'autres: au-delà, son coût fixe (lancement,
+// transferts) est négligeable et l'attente ne ferait que retarder le calcul
+const uint64_t smallJobElements = 1 << 16;
+const double smallJobGemmFlops = 2.0 * 128 * 128 * 128;
+
+bool smallJob(const JobRequest& request)
+{
+  if (request.type == JOB_GEMM)
+    return 2.0 * request.m * request.k * request.n <= smallJobGemmFlops;
+
+  return request.n <= smallJobElements;
+}
+
+/**
+ * Budget des buffers libres de la réserve: un quart de la mémoire du device. Le reste
+ * est laissé aux travaux plus gros que ceux déjà vus.
+ */
+size_t poolIdleBytes(const cl::Device& device)
+{
+  cl_ulong globalMemSize;
+
+  device.getInfo(CL_DEVICE_GLOBAL_MEM_SIZE, &globalMemSize);
+
+  return globalMemSize / 4;
+}
+
+double elapsedUs(std::chrono::steady_clock::time_point begin, std::chrono::steady_clock::time_point end)
+{
+  return std::chrono::duration<double, std::micro>(end - begin).count();
+}
+
+/**
+ * Travail reçu d'une connexion, en attente ou en cours d'exécution.
+ */
+struct Job
+{
+  JobRequest request;
+  JobReply reply;
+  SharedMemory memory;
+
+  std::chrono::steady_clock::time_point received;
+  bool done;
+
+  std::vector<cl::Buffer> buffers;	// Pris dans la réserve, rendus à la fin du travail
+  std::vector<float> h_partials;	// JOB_REDUCE: sommes partielles des work groups
+  cl::Event first;
+  cl::Event last;
+};
+
+const int latencyBucketsPerOctave = 8;
+const int latencyBucketCount = 32 * latencyBucketsPerOctave;	// 1 us à 2^32 us
+
+/**
+ * Histogramme de latences à classes logarithmiques (8 par octave, ~9 % de résolution):
+ * taille fixe quel que soit le nombre de travaux reçus par le service.
+ */
+class LatencyHistogram
+{
+public:
+
+  LatencyHistogram() : _buckets(latencyBucketCount, 0), _count(0), _maxUs(0) {}
+
+  void add(double us)
+  {
+    int bucket = us <= 1 ? 0 : std::min(latencyBucketCount - 1, (int)(log2(us) * latencyBucketsPerOctave));
+
+    ++_buckets[bucket];
+    ++_count;
+    _maxUs = std::max(_maxUs, us);
+  }
+
+  unsigned long count() const { return _count; }
+  double maxUs() const { return _maxUs; }
+
+  /**
+   * Borne supérieure de la classe du quantile 'p' (sans dépasser le maximum observé).
+   */
+  double percentile(double p) const
+  {
+    int bucket;
+    unsigned long rank;
+    unsigned long cumulated = 0;
+
+    if (_count == 0)
+      return 0;
+
+    rank = (unsigned long)(p * (_count - 1) + 0.5) + 1;
+    for (bucket = 0; bucket < latencyBucketCount - 1; ++bucket)
+    {
+      cumulated += _buckets[bucket];
+      if (cumulated >= rank)
+	break;
+    }
+
+    return std::min(_maxUs, pow(2.0, (double)(bucket + 1) / latencyBucketsPerOctave));
+  }
+
+private:
+
+  std::vector<unsigned long> _buckets;
+  unsigned long _count;
+  double _maxUs;
+};
+
+struct JobTypeStats
+{
+  JobTypeStats() : errors(0), deviceUs(0) {}
+
+  LatencyHistogram totalUs;
+  unsigned long errors;
+  double deviceUs;
+};
+
+/**
+ * Connexion cliente et son thread. Le descripteur n'est fermé qu'après le thread, par
+ * le service: il ne peut pas être réutilisé pendant un shutdown() d'arrêt.
+ */
+struct Connection
+{
+  Connection(int fd) : fd(fd), finished(false) {}
+
+  int fd;
+  bool finished;		// Thread terminé, à joindre (sous _mutex)
+  std::thread thread;
+};
+
+/**
+ * Service résident: contexte, file de commandes, programmes, kernels et buffers restent
+ * prêts d'un travail à l'autre. Un thread par connexion reçoit les requêtes; un unique
+ * thread de soumission regroupe les travaux arrivés ensemble (jusqu'à 'batchMax'; un
+ * petit travail attend au plus 'batchWindowUs' ceux en cours de réception), soumet
+ * toutes leurs commandes, puis attend le lot en une fois.
+ *
+ * Les commandes ne passent pas par kite::Counters/kite::Trace, qui conservent chaque
+ * commande pour la durée du processus: le service tient ses propres statistiques.
+ */
+class ComputeService
+{
+public:
+
+  ComputeService(const cl::Context& context, const cl::Device& device, int batchMax, int batchWindowUs)
+    : _context(context), _device(device), _queue(context, device, CL_QUEUE_PROFILING_ENABLE),
+      _pool(context, CL_MEM_READ_WRITE, poolIdleBytes(device)), _batchMax(batchMax), _batchWindowUs(batchWindowUs), _stopping(false), _arriving(0),
+      _batches(0), _batchedJobs(0), _listenFd(-1)
+  {
+    size_t maxWorkGroupSize;
+    std::vector<cl::Device> devices(1, device);
+
+    device.getInfo(CL_DEVICE_MAX_COMPUTE_UNITS, &_computeUnits);
+    device.getInfo(CL_DEVICE_MAX_WORK_GROUP_SIZE, &maxWorkGroupSize);
+    for (_gemmTile = 16; _gemmTile > 1 && (size_t)(_gemmTile * _gemmTile) > maxWorkGroupSize; _gemmTile /= 2)
+      ;
+
+    // GEMM sans épilogue (voir mmul_tiled_epilogue), spécialisé pour la taille de tuile
+    _vadd = cl::Kernel(kite::buildProgram(context, devices, vaddProgram), "vadd_stride");
+    _gemm = cl::Kernel(kite::ProgramCache::instance().get(context, device, mmulSource,
+							  "-D GEMM_TILE=" + std::to_string(_gemmTile)),
+		       "mmul_tiled_epilogue");
+    _reduce = cl::Kernel(kite::buildProgram(context, devices, reduceProgram), "reduce_sum");
+  }
+
+  /**
+   * Accepte les connexions sur 'socketPath' jusqu'à JOB_SHUTDOWN ou stop().
+   */
+  bool run(const std::string& socketPath)
+  {
+    int fd;
+    struct sockaddr_un address;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+
+    // Un service qui répond encore garde sa socket; celle d'un service arrêté
+    // brutalement (connexion refusée) est remplacée
+    fd = connectService(socketPath);
+    if (fd >= 0)
+    {
+      close(fd);
+      fprintf(stderr, "Un service repond deja sur %s\r\n", socketPath.c_str());
+      return false;
+    }
+    if (errno == ECONNREFUSED)
+      unlink(socketPath.c_str());
+
+    _listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (_listenFd < 0)
+    {
+      perror("socket");
+      return false;
+    }
+
+    if (bind(_listenFd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(_listenFd, 64) != 0)
+    {
+      perror(socketPath.c_str());
+      close(_listenFd);
+      return false;
+    }
+
+    std::thread dispatcher(&ComputeService::dispatch, this);
+
+    printf("En attente de travaux sur %s (lots de %d travaux au plus, fenetre de %d us)\r\n",
+	   socketPath.c_str(), _batchMax, _batchWindowUs);
+    printf("\r\n");
+
+    for (;;)
+    {
+      fd = accept(_listenFd, NULL, NULL);
+      if (fd < 0)
+      {
+	if (stopping())
+	  break;
+
+	switch (errno)
+	{
+	case EINTR:
+	case ECONNABORTED:
+	case EPROTO:
+	  continue;
+
+	  // Plus de descripteurs ou de mémoire: nouvel essai après libération des
+	  // connexions terminées
+	case EMFILE:
+	case ENFILE:
+	case ENOBUFS:
+	case ENOMEM:
+	  perror("accept");
+	  joinConnections(false);
+	  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	  continue;
+
+	default:
+	  perror("accept");
+	}
+
+	// Socket d'écoute inutilisable
+	break;
+      }
+
+      joinConnections(false);
+
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      _connections.push_back(Connection(fd));
+      _connections.back().thread = std::thread(&ComputeService::serveConnection, this, &_connections.back());
+    }
+
+    // Réveil du thread de soumission, qui termine les travaux déjà reçus. Les connexions
+    // ne sont fermées qu'en lecture: les réponses de ces travaux sont encore écrites
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      _stopping = true;
+      _pendingCondition.notify_all();
+
+      for (std::list<Connection>::iterator it = _connections.begin(); it != _connections.end(); ++it)
+	shutdown(it->fd, SHUT_RD);
+    }
+    dispatcher.join();
+    joinConnections(true);
+
+    close(_listenFd);
+    unlink(socketPath.c_str());
+
+    printf("%s", statsReport().c_str());
+
+    return true;
+  }
+
+  /**
+   * Arrête d'accepter des connexions; les travaux déjà reçus sont terminés. Appelable
+   * depuis un gestionnaire de signal.
+   */
+  void stop()
+  {
+    _stopping = true;
+    if (_listenFd >= 0)
+      shutdown(_listenFd, SHUT_RDWR);
+  }
+
+  bool stopping() const { return _stopping; }
+
+private:
+
+  /**
+   * Attente des threads de connexion terminés (tous si 'all') et fermeture de leurs
+   * descripteurs.
+   */
+  void joinConnections(bool all)
+  {
+    std::list<Connection> finished;
+    std::list<Connection>::iterator it;
+
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      for (it = _connections.begin(); it != _connections.end(); )
+	if (all || it->finished)
+	  finished.splice(finished.end(), _connections, it++);
+	else
+	  ++it;
+    }
+
+    for (it = finished.begin(); it != finished.end(); ++it)
+    {
+      it->thread.join();
+      close(it->fd);
+    }
+  }
+
+  void serveConnection(Connection* connection)
+  {
+    int fd = connection->fd;
+    JobRequest request;
+    std::string text;
+
+    while (readFully(fd, &request, sizeof(request)))
+    {
+      Job job;
+
+      job.received = std::chrono::steady_clock::now();
+      job.request = request;
+      job.done = false;
+
+      memset(&job.reply, 0, sizeof(job.reply));
+      job.reply.magic = serviceMagic;
+      job.reply.id = request.id;
+      job.reply.status = JOB_OK;
+
+      request.sharedMemory[sizeof(request.sharedMemory) - 1] = '\0';
+
+      if (request.magic != serviceMagic)
+      {
+	job.reply.status = JOB_BAD_REQUEST;
+	writeFully(fd, &job.reply, sizeof(job.reply));
+	break;
+      }
+
+      if (request.type == JOB_STATS)
+      {
+	text = statsReport();
+	job.reply.textBytes = text.size();
+	if (!writeFully(fd, &job.reply, sizeof(job.reply)) || !writeFully(fd, text.data(), text.size()))
+	  break;
+	continue;
+      }
+
+      if (request.type == JOB_SHUTDOWN)
+      {
+	writeFully(fd, &job.reply, sizeof(job.reply));
+	stop();
+	break;
+      }
+
+      // Travail annoncé au thread de soumission pendant l'ouverture de sa mémoire
+      {
+	std::lock_guard<std::mutex> lock(_mutex);
+
+	++_arriving;
+      }
+
+      if (jobSharedBytes(request) == 0)
+	job.reply.status = JOB_BAD_REQUEST;
+      else if (!job.memory.open(request.sharedMemory, jobSharedBytes(request)))
+	job.reply.status = JOB_BAD_SHARED_MEMORY;
+
+      {
+	std::unique_lock<std::mutex> lock(_mutex);
+
+	--_arriving;
+	_pendingCondition.notify_one();
+
+	if (job.reply.status == JOB_OK && _stopping)
+	  job.reply.status = JOB_STOPPING;
+	else if (job.reply.status == JOB_OK)
+	{
+	  _pending.push_back(&job);
+	  _doneCondition.wait(lock, [&] { return job.done; });
+	}
+      }
+
+      if (!writeFully(fd, &job.reply, sizeof(job.reply)))
+	break;
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    connection->finished = true;
+  }
+
+  /**
+   * Thread de soumission: regroupement, soumission et attente des lots.
+   */
+  void dispatch()
+  {
+    size_t i;
+    std::vector<Job*> batch;
+
+    for (;;)
+    {
+      {
+	std::unique_lock<std::mutex> lock(_mutex);
+
+	_pendingCondition.wait(lock, [&] { return !_pending.empty() || _stopping; });
+	if (_pending.empty())
+	  break;
+
+	// Regroupement: un petit travail attend (au plus la fenêtre) ceux en cours de
+	// réception, qui partent avec lui. Un travail seul ou gros part tout de suite
+	if (smallJob(_pending.front()->request))
+	  _pendingCondition.wait_for(lock, std::chrono::microseconds(_batchWindowUs),
+				     [&] { return (int)_pending.size() >= _batchMax || _arriving == 0 || _stopping; });
+
+	batch.clear();
+	while (!_pending.empty() && (int)batch.size() < _batchMax)
+	{
+	  batch.push_back(_pending.front());
+	  _pending.pop_front();
+	}
+      }
+
+      std::chrono::steady_clock::time_point submitted = std::chrono::steady_clock::now();
+
+      for (i = 0; i < batch.size(); ++i)
+      {
+	batch[i]->reply.waitUs = elapsedUs(batch[i]->received, submitted);
+
+	try
+	{
+	  submit(*batch[i]);
+	}
+	catch (const cl::Error& e)
+	{
+	  fprintf(stderr, "Travail %lu: %s (%d)\r\n", (unsigned long)batch[i]->request.id, e.what(), e.err());
+	  batch[i]->reply.status = JOB_DEVICE_ERROR;
+	}
+      }
+
+      try
+      {
+	_queue.finish();
+      }
+      catch (const cl::Error& e)
+      {
+	fprintf(stderr, "Lot de %lu travaux: %s (%d)\r\n", batch.size(), e.what(), e.err());
+	for (i = 0; i < batch.size(); ++i)
+	  batch[i]->reply.status = JOB_DEVICE_ERROR;
+      }
+
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      ++_batches;
+      _batchedJobs += batch.size();
+
+      for (i = 0; i < batch.size(); ++i)
+      {
+	complete(*batch[i]);
+	batch[i]->done = true;
+      }
+      _doneCondition.notify_all();
+    }
+  }
+
+  /**
+   * Commandes d'un travail: envoi des opérandes depuis la mémoire partagée, kernel,
+   * lecture du résultat dans la mémoire partagée. Rien n'est attendu ici.
+   */
+  void submit(Job& job)
+  {
+    size_t i;
+    size_t groups;
+    cl::Event event;
+
+    const JobRequest& request = job.request;
+    float* data = job.memory.data();
+
+    switch (request.type)
+    {
+    case JOB_VADD:
+      for (i = 0; i < 4; ++i)
+	job.buffers.push_back(_pool.acquire(sizeof(float) * request.n));
+
+      _queue.enqueueWriteBuffer(job.buffers[0], CL_FALSE, 0, sizeof(float) * request.n, data, NULL, &job.first);
+      _queue.enqueueWriteBuffer(job.buffers[1], CL_FALSE, 0, sizeof(float) * request.n, data + request.n);
+      _queue.enqueueWriteBuffer(job.buffers[2], CL_FALSE, 0, sizeof(float) * request.n, data + 2 * request.n);
+
+      _vadd.setArg(0, (cl_uint)request.n);
+      for (i = 0; i < 4; ++i)
+	_vadd.setArg(i + 1, job.buffers[i]);
+
+      groups = std::min((size_t)_computeUnits * 4, (request.n + vaddLocalSize - 1) / vaddLocalSize);
+      _queue.enqueueNDRangeKernel(_vadd, cl::NullRange, cl::NDRange(groups * vaddLocalSize), cl::NDRange(vaddLocalSize));
+
+      _queue.enqueueReadBuffer(job.buffers[3], CL_FALSE, 0, sizeof(float) * request.n, data + 3 * request.n, NULL, &job.last);
+      break;
+
+    case JOB_GEMM:
+      {
+	size_t m = request.m;
+	size_t k = request.k;
+	size_t n = request.n;
+
+	job.buffers.push_back(_pool.acquire(sizeof(float) * m * k));
+	job.buffers.push_back(_pool.acquire(sizeof(float) * k * n));
+	job.buffers.push_back(_pool.acquire(sizeof(float) * m * n));
+
+	_queue.enqueueWriteBuffer(job.buffers[0], CL_FALSE, 0, sizeof(float) * m * k, data, NULL, &job.first);
+	_queue.enqueueWriteBuffer(job.buffers[1], CL_FALSE, 0, sizeof(float) * k * n, data + m * k);
+
+	_gemm.setArg(0, (int)m);
+	_gemm.setArg(1, (int)k);
+	_gemm.setArg(2, job.buffers[0]);
+	_gemm.setArg(3, (int)k);
+	_gemm.setArg(4, (int)n);
+	_gemm.setArg(5, job.buffers[1]);
+	_gemm.setArg(6, job.buffers[2]);
+	_gemm.setArg(7, 1.0f);
+	_gemm.setArg(8, 0.0f);
+	_gemm.setArg(9, job.buffers[0]);	// Biais inutilisé
+
+	_queue.enqueueNDRangeKernel(_gemm, cl::NullRange,
+				    cl::NDRange((n + _gemmTile - 1) / _gemmTile * _gemmTile, (m + _gemmTile - 1) / _gemmTile * _gemmTile),
+				    cl::NDRange(_gemmTile, _gemmTile));
+
+	_queue.enqueueReadBuffer(job.buffers[2], CL_FALSE, 0, sizeof(float) * m * n, data + m * k + k * n, NULL, &job.last);
+      }
+      break;
+
+    case JOB_REDUCE:
+      groups = std::min((size_t)_computeUnits * 4, (request.n + reduceLocalSize - 1) / reduceLocalSize);
+      job.h_partials.resize(groups);
+
+      job.buffers.push_back(_pool.acquire(sizeof(float) * request.n));
+      job.buffers.push_back(_pool.acquire(sizeof(float) * groups));
+
+      _queue.enqueueWriteBuffer(job.buffers[0], CL_FALSE, 0, sizeof(float) * request.n, data, NULL, &job.first);
+
+      _reduce.setArg(0, (cl_uint)request.n);
+      _reduce.setArg(1, job.buffers[0]);
+      _reduce.setArg(2, cl::Local(sizeof(float) * reduceLocalSize));
+      _reduce.setArg(3, job.buffers[1]);
+      _queue.enqueueNDRangeKernel(_reduce, cl::NullRange, cl::NDRange(groups * reduceLocalSize), cl::NDRange(reduceLocalSize));
+
+      _queue.enqueueReadBuffer(job.buffers[1], CL_FALSE, 0, sizeof(float) * groups, &job.h_partials[0], NULL, &job.last);
+      break;
+    }
+  }
+
+  /**
+   * Fin d'un travail (lot terminé, _mutex détenu): résultat, statistiques, buffers rendus.
+   */
+  void complete(Job& job)
+  {
+    size_t i;
+
+    JobTypeStats& stats = _stats[job.request.type];
+
+    if (job.reply.status == JOB_OK)
+    {
+      if (job.request.type == JOB_REDUCE)
+	for (i = 0; i < job.h_partials.size(); ++i)
+	  job.reply.value += job.h_partials[i];
+
+      job.reply.deviceUs = (job.last.getProfilingInfo<CL_PROFILING_COMMAND_END>()
+			    - job.first.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-3;
+      job.reply.totalUs = elapsedUs(job.received, std::chrono::steady_clock::now());
+
+      stats.totalUs.add(job.reply.totalUs);
+      stats.deviceUs += job.reply.deviceUs;
+    }
+    else
+      ++stats.errors;
+
+    for (i = 0; i < job.buffers.size(); ++i)
+      _pool.release(job.buffers[i]);
+    job.buffers.clear();
+  }
+
+  std::string statsReport()
+  {
+    int type;
+    char line[256];
+    std::string text;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    snprintf(line, sizeof(line), "%8s %10s %8s %12s %12s %12s %12s %14s\r\n",
+	     "Travail", "Termines", "Erreurs", "p50 (us)", "p95 (us)", "p99 (us)", "max (us)", "device (us)");
+    text += line;
+
+    for (type = JOB_VADD; type <= JOB_REDUCE; ++type)
+    {
+      const JobTypeStats& stats = _stats[type];
+      const LatencyHistogram& totalUs = stats.totalUs;
+
+      snprintf(line, sizeof(line), "%8s %10lu %8lu %12.0f %12.0f %12.0f %12.0f %14.1f\r\n", jobTypeNames[type],
+	       totalUs.count(), stats.errors, totalUs.percentile(0.50), totalUs.percentile(0.95), totalUs.percentile(0.99),
+	       totalUs.maxUs(), totalUs.count() > 0 ? stats.deviceUs / totalUs.count() : 0);
+      text += line;
+    }
+
+    snprintf(line, sizeof(line), "Lots: %lu (%.2f travaux en moyenne)\r\n",
+	     _batches, _batches > 0 ? (double)_batchedJobs / _batches : 0.0);
+    text += line;
+    snprintf(line, sizeof(line), "Reserve de buffers: %lu allocation(s) (%lu octets), %lu reutilisation(s), "
+	     "%lu octets liberes, %lu octets libres\r\n",
+	     _pool.allocations(), _pool.allocatedBytes(), _pool.reuses(), _pool.trimmedBytes(), _pool.idleBytes());
+    text += line;
+
+    return text;
+  }
+
+  cl::Context _context;
+  cl::Device _device;
+  cl::CommandQueue _queue;		// Utilisée par le seul thread de soumission
+  cl_uint _computeUnits;
+  int _gemmTile;
+
+  cl::Kernel _vadd;
+  cl::Kernel _gemm;
+  cl::Kernel _reduce;
+
+  kite::BufferPool _pool;
+
+  int _batchMax;
+  int _batchWindowUs;
+  volatile bool _stopping;
+
+  std::mutex _mutex;
+  std::condition_variable _pendingCondition;
+  std::condition_variable _doneCondition;
+  std::deque<Job*> _pending;
+  int _arriving;			// Travaux lus, pas encore dans _pending
+  std::list<Connection> _connections;
+
+  JobTypeStats _stats[JOB_REDUCE + 1];
+  unsigned long _batches;
+  unsigned long _batchedJobs;
+
+  int _listenFd;
+};
+
+ComputeService* runningService = NULL;
+
+void stopService(int)
+{
+  if (runningService != NULL)
+    runningService->stop();
+}
+
+int runService(const std::string& socketPath, int batchMax, int batchWindowUs)
+{
+  size_t deviceId;
+  std::string deviceName;
+
+  cl::Context context;
+  std::vector<cl::Device> devices;
+
+  struct sigaction action;
+
+  try
+  {
+    util::Timer timer;
+
+    context = cl::Context(CL_DEVICE_TYPE_ALL);
+    context.getInfo(CL_CONTEXT_DEVICES, &devices);
+
+    deviceId = kite::selectDevice(devices);
+    devices[deviceId].getInfo(CL_DEVICE_NAME, &deviceName);
+
+    ComputeService service(context, devices[deviceId], batchMax, batchWindowUs);
+
+    printf("Device [%lu]: %s, service pret en %lu us\r\n", deviceId, deviceName.c_str(), timer.getTimeMicroseconds());
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stopService;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    runningService = &service;
+    bool served = service.run(socketPath);
+    runningService = NULL;
+
+    kite::ProgramCache::instance().printStats();
+
+    return served ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  catch (const cl::Error& e)
+  {
+    fprintf(stderr, "Exception: %s (%d)\r\n", e.what(), e.err());
+
+    return EXIT_FAILURE;
+  }
+}
+
+/* ========== Client ========== */
+
+struct ClientOptions
+{
+  std::string socketPath;
+  JobType type;
+  size_t size;			// vadd/reduce: éléments, gemm: ordre des matrices
+  int jobsPerThread;
+};
+
+struct ClientResult
+{
+  ClientResult() : succeeded(0), errors(0), serverUs(0), deviceUs(0) {}
+
+  std::vector<double> roundTripUs;
+  unsigned long succeeded;
+  unsigned long errors;
+  double serverUs;
+  double deviceUs;
+};
+
+/**
+ * Opérandes à valeurs entières petites: les résultats sont exacts en float.
+ */
+void fillClientOperands(const ClientOptions& options, float* data)
+{
+  size_t i;
+  size_t n = options.size;
+
+  if (options.type == JOB_VADD)
+    for (i = 0; i < 3 * n; ++i)
+      data[i] = (float)(i % 7) - 3;
+  else if (options.type == JOB_GEMM)
+    for (i = 0; i < 2 * n * n; ++i)
+      data[i] = (float)(i % 5) - 2;
+  else
+    for (i = 0; i < n; ++i)
+      data[i] = (float)(i % 4);
+}
+
+bool checkClientResult(const ClientOptions& options, const float* data, double value)
+{
+  size_t i;
+  size_t j;
+  size_t r;
+  size_t c;
+  size_t n = options.size;
+
+  double expected;
+
+  if (options.type == JOB_VADD)
+  {
+    for (i = 0; i < n; ++i)
+      if (data[3 * n + i] != data[i] + data[n + i] + data[2 * n + i])
+	return false;
+  }
+  else if (options.type == JOB_GEMM)
+  {
+    // Quelques cases réparties sur la matrice
+    for (i = 0; i < 64; ++i)
+    {
+      r = (i * 7919) % n;
+      c = (i * 104729) % n;
+
+      expected = 0;
+      for (j = 0; j < n; ++j)
+	expected += data[r * n + j] * data[n * n + j * n + c];
+
+      if (data[2 * n * n + r * n + c] != expected)
+	return false;
+    }
+  }
+  else
+  {
+    expected = 0;
+    for (i = 0; i < n; ++i)
+      expected += data[i];
+
+    if (fabs(value - expected) > 1e-6 * expected)
+      return false;
+  }
+
+  return true;
+}
+
+/**
+ * Un thread client: sa connexion, sa mémoire partagée, et 'jobsPerThread' travaux
+ * envoyés l'un après l'autre.
+ */
+void clientThread(const ClientOptions* options, int thread, ClientResult* result)
+{
+  int i;
+  int fd;
+  size_t bytes;
+
+  JobRequest request;
+  JobReply reply;
+  SharedMemory memory;
+
+  std::string name = "/kite-" + std::to_string(getpid()) + "-" + std::to_string(thread);
+
+  memset(&request, 0, sizeof(request));
+  request.magic = serviceMagic;
+  request.type = options->type;
+  request.m = options->type == JOB_GEMM ? options->size : 0;
+  request.k = options->type == JOB_GEMM ? options->size : 0;
+  request.n = options->size;
+  strncpy(request.sharedMemory, name.c_str(), sizeof(request.sharedMemory) - 1);
+
+  bytes = jobSharedBytes(request);
+  if (bytes == 0 || !memory.create(name, bytes))
+  {
+    result->errors = options->jobsPerThread;
+    return;
+  }
+
+  fillClientOperands(*options, memory.data());
+
+  fd = connectService(options->socketPath);
+  if (fd < 0)
+  {
+    result->errors = options->jobsPerThread;
+    return;
+  }
+
+  for (i = 0; i < options->jobsPerThread; ++i)
+  {
+    request.id = (uint64_t)thread * options->jobsPerThread + i;
+
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+    if (!writeFully(fd, &request, sizeof(request)) || !readFully(fd, &reply, sizeof(reply)))
+    {
+      result->errors += options->jobsPerThread - i;
+      break;
+    }
+
+    result->roundTripUs.push_back(elapsedUs(begin, std::chrono::steady_clock::now()));
+
+    if (reply.status != JOB_OK || reply.id != request.id || !checkClientResult(*options, memory.data(), reply.value))
+      ++result->errors;
+    else
+    {
+      ++result->succeeded;
+      result->serverUs += reply.totalUs;
+      result->deviceUs += reply.deviceUs;
+    }
+  }
+
+  close(fd);
+}
+
+int runClient(const ClientOptions& options, int threadCount)
+{
+  int t;
+  double seconds;
+
+  ClientResult total;
+  std::vector<ClientResult> results(threadCount);
+  std::vector<std::thread> threads;
+
+  util::Timer timer;
+
+  for (t = 0; t < threadCount; ++t)
+    threads.push_back(std::thread(clientThread, &options, t, &results[t]));
+  for (t = 0; t < threadCount; ++t)
+    threads[t].join();
+
+  seconds = timer.getTimeMicroseconds() * 1e-6;
+
+  for (t = 0; t < threadCount; ++t)
+  {
+    total.roundTripUs.insert(total.roundTripUs.end(), results[t].roundTripUs.begin(), results[t].roundTripUs.end());
+    total.succeeded += results[t].succeeded;
+    total.errors += results[t].errors;
+    total.serverUs += results[t].serverUs;
+    total.deviceUs += results[t].deviceUs;
+  }
+  std::sort(total.roundTripUs.begin(), total.roundTripUs.end());
+
+  printf("Travaux %s (taille %lu): %d thread(s) x %d\r\n", jobTypeNames[options.type], options.size, threadCount, options.jobsPerThread);
+  printf("\r\n");
+  printf("%10s %8s %12s %12s %12s %12s %14s %14s\r\n",
+	 "Travaux/s", "Erreurs", "p50 (us)", "p95 (us)", "p99 (us)", "max (us)", "service (us)", "device (us)");
+  printf("%10.1f %8lu %12.0f %12.0f %12.0f %12.0f %14.1f %14.1f\r\n",
+	 total.roundTripUs.size() / seconds, total.errors,
+	 percentile(total.roundTripUs, 0.50), percentile(total.roundTripUs, 0.95), percentile(total.roundTripUs, 0.99),
+	 total.roundTripUs.empty() ? 0 : total.roundTripUs.back(),
+	 total.succeeded > 0 ? total.serverUs / total.succeeded : 0, total.succeeded > 0 ? total.deviceUs / total.succeeded : 0);
+  printf("\r\n");
+
+  return total.errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Requête sans opérandes: JOB_STATS (rapport affiché) ou JOB_SHUTDOWN.
+ */
+int sendControl(const std::string& socketPath, JobType type)
+{
+  int fd;
+  JobRequest request;
+  JobReply reply;
+  std::vector<char> text;
+
+  fd = connectService(socketPath);
+  if (fd < 0)
+  {
+    fprintf(stderr, "Service injoignable sur %s\r\n", socketPath.c_str());
+    return EXIT_FAILURE;
+  }
+
+  memset(&request, 0, sizeof(request));
+  request.magic = serviceMagic;
+  request.type = type;
+
+  bool received = writeFully(fd, &request, sizeof(request)) && readFully(fd, &reply, sizeof(reply));
+  if (received && reply.textBytes > 0)
+  {
+    text.resize(reply.textBytes);
+    received = readFully(fd, &text[0], text.size());
+  }
+  close(fd);
+
+  if (!received || reply.status != JOB_OK)
+    return EXIT_FAILURE;
+
+  if (!text.empty())
+    fwrite(&text[0], 1, text.size(), stdout);
+
+  return EXIT_SUCCESS;
+}
+
+/* ========== Application ========== */
+
+int main(int argc, char** argv)
+{
+  int i;
+  int threadCount;
+  int batchMax;
+  int batchWindowUs;
+  bool serve;
+  bool stats;
+  bool shutdownService;
+  long size;
+  const char* clientType;
+
+  ClientOptions options;
+
+  // --serve: service résident, --batch n travaux p/ lot au plus (défaut 16) et
+  //   --window us d'attente de regroupement au plus après un petit travail (défaut 200)
+  // --client vadd|gemm|reduce: envoie --jobs n travaux (défaut 100) depuis --threads t
+  //   clients (défaut 4), de taille --size n (éléments, ou ordre des matrices)
+  // --stats: statistiques du service, --shutdown: arrêt du service
+  // --socket chemin: socket du service (défaut /tmp/kite-compute-<uid>.sock)
+  serve = false;
+  stats = false;
+  shutdownService = false;
+  clientType = NULL;
+  batchMax = 16;
+  batchWindowUs = 200;
+  threadCount = 4;
+  size = 0;
+  options.socketPath = defaultSocketPath();
+  options.jobsPerThread = 100;
+  for (i = 1; i < argc; ++i)
+    if (strcmp(argv[i], "--serve") == 0)
+      serve = true;
+    else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+      batchMax = std::max(1, atoi(argv[++i]));
+    else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc)
+      batchWindowUs = std::max(0, atoi(argv[++i]));
+    else if (strcmp(argv[i], "--client") == 0 && i + 1 < argc)
+      clientType = argv[++i];
+    else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc)
+      options.jobsPerThread = std::max(1, atoi(argv[++i]));
+    else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+      threadCount = std::max(1, atoi(argv[++i]));
+    else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc)
+      size = atol(argv[++i]);
+    else if (strcmp(argv[i], "--stats") == 0)
+      stats = true;
+    else if (strcmp(argv[i], "--shutdown") == 0)
+      shutdownService = true;
+    else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc)
+      options.socketPath = argv[++i];
+
+  if (serve)
+    return runService(options.socketPath, batchMax, batchWindowUs);
+  if (stats)
+    return sendControl(options.socketPath, JOB_STATS);
+  if (shutdownService)
+    return sendControl(options.socketPath, JOB_SHUTDOWN);
+
+  if (clientType == NULL)
+  {
+    fprintf(stderr, "Usage: %s --serve | --client vadd|gemm|reduce | --stats | --shutdown\r\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (strcmp(clientType, "vadd") == 0)
+    options.type = JOB_VADD;
+  else if (strcmp(clientType, "gemm") == 0)
+    options.type = JOB_GEMM;
+  else if (strcmp(clientType, "reduce") == 0)
+    options.type = JOB_REDUCE;
+  else
+  {
+    fprintf(stderr, "Travail inconnu: %s\r\n", clientType);
+    return EXIT_FAILURE;
+  }
+
+  options.size = size > 0 ? size : options.type == JOB_GEMM ? 256 : 1 << 20;
+
+  return runClient(options, threadCount);
+}
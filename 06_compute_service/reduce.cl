@@ -0,0 +1,34 @@
+/**
+ * Somme de n réels, 1 somme partielle p/ work group: chaque work item accumule avec un
+ * pas égal à la taille globale ("grid stride"), puis le work group réduit en mémoire
+ * locale (taille du work group: puissance de 2). Les sommes partielles sont additionnées
+ * sur l'hôte.
+ */
+__kernel void reduce_sum(const uint n, __global const float* g_x,
+			 __local float* l_sums, __global float* g_partials)
+{
+  uint i;
+  uint s;
+
+  uint lid;
+  float sum;
+
+  lid = get_local_id(0);
+
+  sum = 0;
+  for (i = get_global_id(0); i < n; i += get_global_size(0))
+    sum += g_x[i];
+
+  l_sums[lid] = sum;
+  barrier(CLK_LOCAL_MEM_FENCE);
+
+  for (s = get_local_size(0) / 2; s > 0; s /= 2)
+  {
+    if (lid < s)
+      l_sums[lid] += l_sums[lid + s];
+    barrier(CLK_LOCAL_MEM_FENCE);
+  }
+
+  if (lid == 0)
+    g_partials[get_group_id(0)] = l_sums[0];
+}
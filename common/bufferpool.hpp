@@ -0,0 +1,134 @@
+#ifndef KITE_BUFFERPOOL_HPP
+#define KITE_BUFFERPOOL_HPP
+
+/**
+ * Reserve de buffers device reutilisables.
+ *
+ * Les tailles sont arrondies a la puissance de 2 superieure (minimum 4 Ko): un
+ * buffer libere sert a toute demande de la meme classe, sans nouvelle allocation
+ * ni premier acces couteux (pages du pilote deja en place). Les buffers libres
+ * gardes ne depassent pas un budget d'octets: au-dela, les plus grands sont
+ * rendus au pilote. Utilisable depuis plusieurs threads host.
+ */
+
+#include <cl.hpp>
+
+#include <map>
+#include <mutex>
+#include <vector>
+#include <cstdio>
+
+namespace kite
+{
+  class BufferPool
+  {
+  public:
+
+    /**
+     * 'maxIdleBytes': taille totale des buffers libres gardes pour reutilisation.
+     */
+    BufferPool(const cl::Context& context, cl_mem_flags flags = CL_MEM_READ_WRITE,
+	       size_t maxIdleBytes = 256 << 20)
+      : _context(context), _flags(flags), _maxIdleBytes(maxIdleBytes), _idleBytes(0),
+	_allocations(0), _reuses(0), _allocatedBytes(0), _trimmedBytes(0) {}
+
+    static size_t sizeClass(size_t bytes)
+    {
+      size_t size = 4096;
+
+      while (size < bytes)
+	size *= 2;
+
+      return size;
+    }
+
+    /**
+     * Buffer d'au moins 'bytes' octets, a rendre par release().
+     */
+    cl::Buffer acquire(size_t bytes)
+    {
+      size_t size = sizeClass(bytes);
+
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      std::vector<cl::Buffer>& free = _free[size];
+      if (!free.empty())
+      {
+	cl::Buffer buffer = free.back();
+	free.pop_back();
+
+	_idleBytes -= size;
+	++_reuses;
+	return buffer;
+      }
+
+      ++_allocations;
+      _allocatedBytes += size;
+
+      return cl::Buffer(_context, _flags, size);
+    }
+
+    void release(const cl::Buffer& buffer)
+    {
+      size_t size;
+
+      // Rendus au pilote apres liberation du verrou
+      std::vector<cl::Buffer> trimmed;
+
+      buffer.getInfo(CL_MEM_SIZE, &size);
+
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      _free[size].push_back(buffer);
+      _idleBytes += size;
+
+      // Budget depasse: les plus grandes classes d'abord, qui liberent le plus avec
+      // le moins de buffers et sont les moins souvent redemandees
+      std::map<size_t, std::vector<cl::Buffer> >::reverse_iterator it = _free.rbegin();
+      while (_idleBytes > _maxIdleBytes && it != _free.rend())
+      {
+	if (it->second.empty())
+	{
+	  ++it;
+	  continue;
+	}
+
+	trimmed.push_back(it->second.back());
+	it->second.pop_back();
+
+	_idleBytes -= it->first;
+	_trimmedBytes += it->first;
+      }
+    }
+
+    unsigned long allocations() { std::lock_guard<std::mutex> lock(_mutex); return _allocations; }
+    unsigned long reuses() { std::lock_guard<std::mutex> lock(_mutex); return _reuses; }
+    unsigned long allocatedBytes() { std::lock_guard<std::mutex> lock(_mutex); return _allocatedBytes; }
+    unsigned long trimmedBytes() { std::lock_guard<std::mutex> lock(_mutex); return _trimmedBytes; }
+    unsigned long idleBytes() { std::lock_guard<std::mutex> lock(_mutex); return _idleBytes; }
+
+    void printStats()
+    {
+      printf("Reserve de buffers: %lu allocation(s) (%lu octets), %lu reutilisation(s), %lu octets liberes, %lu octets libres\r\n",
+	     allocations(), allocatedBytes(), reuses(), trimmedBytes(), idleBytes());
+    }
+
+  private:
+
+    cl::Context _context;
+    cl_mem_flags _flags;
+    size_t _maxIdleBytes;
+    size_t _idleBytes;
+
+    std::map<size_t, std::vector<cl::Buffer> > _free;
+
+    unsigned long _allocations;
+    unsigned long _reuses;
+    unsigned long _allocatedBytes;
+    unsigned long _trimmedBytes;
+
+    std::mutex _mutex;
+  };
+}
+
+#endif
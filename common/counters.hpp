@@ -0,0 +1,313 @@
+#ifndef KITE_COUNTERS_HPP
+#define KITE_COUNTERS_HPP
+
+/**
+ * Compteurs du chemin critique: octets transferes host->device et
+ * device->host, nombre de lancements, et pour chaque kernel les flops et octets
+ * theoriques fournis par l'appelant. Le rapport donne les GFLOP/s, GB/s et
+ * l'intensite arithmetique obtenus, et la distance au "roofline" du device si
+ * ses performances crete ont ete mesurees (measureDevicePeaks()).
+ *
+ * Les commandes passees par ces fonctions sont aussi enregistrees dans la trace.
+ * Les compteurs peuvent etre incrementes depuis plusieurs threads host.
+ */
+
+#include <cl.hpp>
+#include <trace.hpp>
+
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <mutex>
+#include <cstdio>
+
+namespace kite
+{
+  /**
+   * Cout theorique d'un lancement de kernel.
+   */
+  struct KernelCost
+  {
+    KernelCost(double flops = 0, double bytes = 0) : flops(flops), bytes(bytes) {}
+
+    double flops;
+    double bytes;		// Octets lus et ecrits en memoire globale
+  };
+
+  /**
+   * Performances crete mesurees d'un device.
+   */
+  struct DevicePeaks
+  {
+    DevicePeaks() : gflops(0), gbytesPerSecond(0) {}
+
+    double gflops;
+    double gbytesPerSecond;
+  };
+
+  class Counters
+  {
+  public:
+
+    static Counters& instance()
+    {
+      static Counters counters;
+      return counters;
+    }
+
+    void recordWrite(size_t bytes)
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      _hostToDeviceBytes += bytes;
+      ++_hostToDeviceCommands;
+    }
+
+    void recordRead(size_t bytes)
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      _deviceToHostBytes += bytes;
+      ++_deviceToHostCommands;
+    }
+
+    void recordLaunch(const std::string& name, const cl::Event& event, const KernelCost& cost)
+    {
+      Launch launch;
+
+      launch.name = name;
+      launch.event = event;
+      launch.cost = cost;
+
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      _launches.push_back(launch);
+    }
+
+    void setDevicePeaks(const DevicePeaks& peaks) { _peaks = peaks; }
+
+    /**
+     * Attend la fin des kernels lances et affiche le rapport.
+     */
+    void printReport()
+    {
+      size_t i;
+
+      std::map<std::string, KernelStats> stats;
+      std::map<std::string, KernelStats>::const_iterator it;
+
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      for (i = 0; i < _launches.size(); ++i)
+      {
+	Launch& launch = _launches[i];
+	KernelStats& s = stats[launch.name];
+
+	launch.event.wait();
+
+	s.launches += 1;
+	s.flops += launch.cost.flops;
+	s.bytes += launch.cost.bytes;
+	s.timeNs += launch.event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - launch.event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+      }
+
+      printf("---------- Compteurs ----------\r\n");
+      printf("\r\n");
+      printf("Transferts host->device: %lu octets (%lu commandes)\r\n", _hostToDeviceBytes, _hostToDeviceCommands);
+      printf("Transferts device->host: %lu octets (%lu commandes)\r\n", _deviceToHostBytes, _deviceToHostCommands);
+      printf("Lancements de kernels: %lu\r\n", _launches.size());
+      if (_peaks.gflops > 0)
+	printf("Crete device: %.1f GFLOP/s, %.1f GB/s (point d'inflexion: %.2f flop/octet)\r\n",
+	       _peaks.gflops, _peaks.gbytesPerSecond, _peaks.gflops / _peaks.gbytesPerSecond);
+      printf("\r\n");
+
+      printf("%-24s %8s %12s %10s %10s %10s %10s\r\n", "Kernel", "Lanc.", "Temps (us)", "GFLOP/s", "GB/s", "flop/oct.", "Roofline");
+      for (it = stats.begin(); it != stats.end(); ++it)
+      {
+	const KernelStats& s = it->second;
+
+	double seconds = s.timeNs * 1e-9;
+	double gflops = seconds > 0 ? s.flops / seconds * 1e-9 : 0;
+	double gbytesPerSecond = seconds > 0 ? s.bytes / seconds * 1e-9 : 0;
+	double intensity = s.bytes > 0 ? s.flops / s.bytes : 0;
+
+	printf("%-24s %8lu %12.0f %10.2f %10.2f %10.3f ", it->first.c_str(), s.launches, s.timeNs * 1e-3, gflops, gbytesPerSecond, intensity);
+
+	// Borne du roofline: min(crete de calcul, intensite * crete de bande passante)
+	if (_peaks.gflops > 0 && s.flops > 0)
+	  printf("%9.1f%%\r\n", 100.0 * gflops / std::min(_peaks.gflops, intensity * _peaks.gbytesPerSecond));
+	else
+	  printf("%10s\r\n", "-");
+      }
+      printf("\r\n");
+    }
+
+  private:
+
+    struct Launch
+    {
+      std::string name;
+      cl::Event event;
+      KernelCost cost;
+    };
+
+    struct KernelStats
+    {
+      KernelStats() : launches(0), flops(0), bytes(0), timeNs(0) {}
+
+      unsigned long launches;
+      double flops;
+      double bytes;
+      double timeNs;
+    };
+
+    Counters()
+      : _hostToDeviceBytes(0), _hostToDeviceCommands(0),
+	_deviceToHostBytes(0), _deviceToHostCommands(0) {}
+
+    unsigned long _hostToDeviceBytes;
+    unsigned long _hostToDeviceCommands;
+    unsigned long _deviceToHostBytes;
+    unsigned long _deviceToHostCommands;
+
+    std::vector<Launch> _launches;
+
+    DevicePeaks _peaks;
+
+    std::mutex _mutex;
+  };
+
+  /* ========== Commandes instrumentees ========== */
+
+  inline cl::Event enqueueWrite(cl::CommandQueue& queue, const cl::Buffer& buffer, size_t offset, size_t size, const void* ptr,
+				const VECTOR_CLASS<cl::Event>* waitList, const std::string& name, bool blocking = false)
+  {
+    cl::Event event;
+
+    queue.enqueueWriteBuffer(buffer, blocking ? CL_TRUE : CL_FALSE, offset, size, ptr, waitList, &event);
+
+    Counters::instance().recordWrite(size);
+    Trace::instance().recordCommand(queue, event, name, "write");
+
+    return event;
+  }
+
+  inline cl::Event enqueueRead(cl::CommandQueue& queue, const cl::Buffer& buffer, size_t offset, size_t size, void* ptr,
+			       const VECTOR_CLASS<cl::Event>* waitList, const std::string& name, bool blocking = false)
+  {
+    cl::Event event;
+
+    queue.enqueueReadBuffer(buffer, blocking ? CL_TRUE : CL_FALSE, offset, size, ptr, waitList, &event);
+
+    Counters::instance().recordRead(size);
+    Trace::instance().recordCommand(queue, event, name, "read");
+
+    return event;
+  }
+
+  /**
+   * Enregistre un lancement deja soumis (par exemple via cl::make_kernel).
+   */
+  inline void recordLaunch(const cl::CommandQueue& queue, const cl::Event& event, const std::string& name, const KernelCost& cost)
+  {
+    Counters::instance().recordLaunch(name, event, cost);
+    Trace::instance().recordCommand(queue, event, name, "kernel");
+  }
+
+  inline cl::Event enqueueKernel(cl::CommandQueue& queue, const cl::Kernel& kernel, const cl::NDRange& global, const cl::NDRange& local,
+				 const VECTOR_CLASS<cl::Event>* waitList, const std::string& name, const KernelCost& cost)
+  {
+    cl::Event event;
+
+    queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local, waitList, &event);
+
+    recordLaunch(queue, event, name, cost);
+
+    return event;
+  }
+
+  /* ========== Mesure des performances crete ========== */
+
+  /**
+   * Mesure la bande passante globale (copie de float4) et le debit de calcul
+   * (8 chaines independantes de mad) du device, meilleur temps sur quelques essais.
+   */
+  inline DevicePeaks measureDevicePeaks(const cl::Context& context, const cl::Device& device)
+  {
+    static const char* source =
+      "__kernel void peak_copy(__global const float4* src, __global float4* dst)\n"
+      "{\n"
+      "  size_t i = get_global_id(0);\n"
+      "  dst[i] = src[i];\n"
+      "}\n"
+      "__kernel void peak_mad(__global float* out, const float seed)\n"
+      "{\n"
+      "  int i;\n"
+      "  float a = seed + get_global_id(0);\n"
+      "  float b = 1.0f - seed;\n"
+      "  float x0 = a, x1 = a + 1, x2 = a + 2, x3 = a + 3, x4 = a + 4, x5 = a + 5, x6 = a + 6, x7 = a + 7;\n"
+      "  for (i = 0; i < 256; ++i)\n"
+      "  {\n"
+      "    x0 = mad(x0, b, a); x1 = mad(x1, b, a); x2 = mad(x2, b, a); x3 = mad(x3, b, a);\n"
+      "    x4 = mad(x4, b, a); x5 = mad(x5, b, a); x6 = mad(x6, b, a); x7 = mad(x7, b, a);\n"
+      "  }\n"
+      "  out[get_global_id(0)] = x0 + x1 + x2 + x3 + x4 + x5 + x6 + x7;\n"
+      "}\n";
+
+    const int tries = 5;
+    const size_t copyFloat4Count = 4 * 1024 * 1024;	// 64 Mo p/ buffer
+    const size_t madWorkItems = 1024 * 1024;
+    const double madFlopsPerWorkItem = 256 * 8 * 2;
+
+    int i;
+    double bestNs;
+    DevicePeaks peaks;
+
+    cl::Event event;
+    cl::CommandQueue queue(context, device, CL_QUEUE_PROFILING_ENABLE);
+
+    cl::Program program(context, std::string(source));
+    program.build();
+
+    cl::Buffer d_src(context, CL_MEM_READ_ONLY, 16 * copyFloat4Count);
+    cl::Buffer d_dst(context, CL_MEM_WRITE_ONLY, 16 * copyFloat4Count);
+    cl::Buffer d_out(context, CL_MEM_WRITE_ONLY, sizeof(float) * madWorkItems);
+
+    cl::Kernel copyKernel(program, "peak_copy");
+    copyKernel.setArg(0, d_src);
+    copyKernel.setArg(1, d_dst);
+
+    cl::Kernel madKernel(program, "peak_mad");
+    madKernel.setArg(0, d_out);
+    madKernel.setArg(1, 0.5f);
+
+    bestNs = 0;
+    for (i = 0; i < tries; ++i)
+    {
+      queue.enqueueNDRangeKernel(copyKernel, cl::NullRange, cl::NDRange(copyFloat4Count), cl::NullRange, NULL, &event);
+      event.wait();
+
+      double ns = event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+      if (i == 0 || ns < bestNs)
+	bestNs = ns;
+    }
+    peaks.gbytesPerSecond = 2.0 * 16 * copyFloat4Count / bestNs;
+
+    bestNs = 0;
+    for (i = 0; i < tries; ++i)
+    {
+      queue.enqueueNDRangeKernel(madKernel, cl::NullRange, cl::NDRange(madWorkItems), cl::NullRange, NULL, &event);
+      event.wait();
+
+      double ns = event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+      if (i == 0 || ns < bestNs)
+	bestNs = ns;
+    }
+    peaks.gflops = madFlopsPerWorkItem * madWorkItems / bestNs;
+
+    return peaks;
+  }
+}
+
+#endif
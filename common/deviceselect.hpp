@@ -0,0 +1,301 @@
+#ifndef KITE_DEVICESELECT_HPP
+#define KITE_DEVICESELECT_HPP
+
+/**
+ * Choix automatique du device le plus rapide.
+ *
+ * Chaque device est evalue par une mesure courte: bande passante globale (copie
+ * de float4) et debit d'un GEMM en tuiles de memoire locale. Le resultat est
+ * enregistre dans le cache disque (voir programcache.hpp) sous l'identite du
+ * device et du pilote: les executions suivantes ne mesurent plus rien. La
+ * variable KITE_DEVICE=n force le choix du device n.
+ */
+
+#include <cl.hpp>
+#include <programcache.hpp>
+#include <trace.hpp>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+namespace kite
+{
+  struct DeviceProbe
+  {
+    DeviceProbe() : gbytesPerSecond(0), gemmGflops(0), cached(false) {}
+
+    /**
+     * Moyenne geometrique: un device n'est bien classe que s'il est bon pour les
+     * kernels limites par la memoire comme pour ceux limites par le calcul.
+     */
+    double score() const { return sqrt(gbytesPerSecond * gemmGflops); }
+
+    double gbytesPerSecond;
+    double gemmGflops;
+    bool cached;		// Lu dans le cache disque
+  };
+
+  inline const char* probeSource()
+  {
+    return
+      "__kernel void probe_copy(__global const float4* src, __global float4* dst)\n"
+      "{\n"
+      "  size_t i = get_global_id(0);\n"
+      "  dst[i] = src[i];\n"
+      "}\n"
+      "\n"
+      "__kernel void probe_gemm(const int n, __global const float* a, __global const float* b, __global float* c)\n"
+      "{\n"
+      "  __local float l_a[PROBE_TILE][PROBE_TILE];\n"
+      "  __local float l_b[PROBE_TILE][PROBE_TILE];\n"
+      "  int i, t;\n"
+      "  int lc = get_local_id(0), lr = get_local_id(1);\n"
+      "  int col = get_global_id(0), r = get_global_id(1);\n"
+      "  float sum = 0;\n"
+      "  for (t = 0; t < n; t += PROBE_TILE)\n"
+      "  {\n"
+      "    l_a[lr][lc] = a[r * n + t + lc];\n"
+      "    l_b[lr][lc] = b[(t + lr) * n + col];\n"
+      "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+      "    for (i = 0; i < PROBE_TILE; ++i)\n"
+      "      sum += l_a[lr][i] * l_b[i][lc];\n"
+      "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+      "  }\n"
+      "  c[r * n + col] = sum;\n"
+      "}\n";
+  }
+
+  // Tailles de la mesure
+  const int probeTries = 3;
+  const size_t probeCopyFloat4Count = 1024 * 1024;	// 16 Mo p/ buffer
+  const int probeGemmOrder = 512;
+
+  /**
+   * Tuile carree du GEMM de mesure: la plus grande (16 au plus) qui tient dans un
+   * work group de 'device'.
+   */
+  inline int probeTile(const cl::Device& device)
+  {
+    int tile;
+    size_t maxWorkGroupSize;
+
+    device.getInfo(CL_DEVICE_MAX_WORK_GROUP_SIZE, &maxWorkGroupSize);
+    for (tile = 16; tile > 1 && (size_t)(tile * tile) > maxWorkGroupSize; tile /= 2)
+      ;
+
+    return tile;
+  }
+
+  inline std::string probeOptions(int tile)
+  {
+    return "-D PROBE_TILE=" + std::to_string(tile);
+  }
+
+  /**
+   * Meilleure duree de 'tries' executions de 'kernel', en nanosecondes.
+   */
+  inline double bestKernelTimeNs(cl::CommandQueue& queue, const cl::Kernel& kernel,
+				 const cl::NDRange& global, const cl::NDRange& local, int tries)
+  {
+    int i;
+    double ns;
+    double bestNs = 0;
+
+    cl::Event event;
+
+    for (i = 0; i < tries; ++i)
+    {
+      queue.enqueueNDRangeKernel(kernel, cl::NullRange, global, local, NULL, &event);
+      event.wait();
+
+      ns = event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+      if (i == 0 || ns < bestNs)
+	bestNs = ns;
+    }
+
+    return bestNs;
+  }
+
+  /**
+   * Mesure courte de 'device' dans son propre contexte (~100 ms).
+   */
+  inline DeviceProbe measureDevice(const cl::Device& device)
+  {
+    int tile;
+    DeviceProbe probe;
+
+    TraceSpan span("Mesure du device");
+
+    tile = probeTile(device);
+
+    cl::Context context(std::vector<cl::Device>(1, device));
+    cl::CommandQueue queue(context, device, CL_QUEUE_PROFILING_ENABLE);
+    cl::Program program = ProgramCache::instance().get(context, device, probeSource(), probeOptions(tile));
+
+    cl::Buffer d_src(context, CL_MEM_READ_WRITE, 16 * probeCopyFloat4Count);
+    cl::Buffer d_dst(context, CL_MEM_READ_WRITE, 16 * probeCopyFloat4Count);
+    cl::Buffer d_a(context, CL_MEM_READ_WRITE, sizeof(float) * probeGemmOrder * probeGemmOrder);
+    cl::Buffer d_b(context, CL_MEM_READ_WRITE, sizeof(float) * probeGemmOrder * probeGemmOrder);
+    cl::Buffer d_c(context, CL_MEM_READ_WRITE, sizeof(float) * probeGemmOrder * probeGemmOrder);
+
+    // Pages touchees avant la mesure
+    queue.enqueueFillBuffer(d_src, 1.0f, 0, 16 * probeCopyFloat4Count);
+    queue.enqueueFillBuffer(d_dst, 0.0f, 0, 16 * probeCopyFloat4Count);
+    queue.enqueueFillBuffer(d_a, 1.0f, 0, sizeof(float) * probeGemmOrder * probeGemmOrder);
+    queue.enqueueFillBuffer(d_b, 1.0f, 0, sizeof(float) * probeGemmOrder * probeGemmOrder);
+    queue.enqueueFillBuffer(d_c, 0.0f, 0, sizeof(float) * probeGemmOrder * probeGemmOrder);
+
+    cl::Kernel copyKernel(program, "probe_copy");
+    copyKernel.setArg(0, d_src);
+    copyKernel.setArg(1, d_dst);
+
+    cl::Kernel gemmKernel(program, "probe_gemm");
+    gemmKernel.setArg(0, probeGemmOrder);
+    gemmKernel.setArg(1, d_a);
+    gemmKernel.setArg(2, d_b);
+    gemmKernel.setArg(3, d_c);
+
+    probe.gbytesPerSecond = 2.0 * 16 * probeCopyFloat4Count
+      / bestKernelTimeNs(queue, copyKernel, cl::NDRange(probeCopyFloat4Count), cl::NullRange, probeTries);
+    probe.gemmGflops = 2.0 * probeGemmOrder * probeGemmOrder * probeGemmOrder
+      / bestKernelTimeNs(queue, gemmKernel, cl::NDRange(probeGemmOrder, probeGemmOrder), cl::NDRange(tile, tile), probeTries);
+
+    return probe;
+  }
+
+  /**
+   * Mesure de 'device' depuis le cache disque, sinon mesuree puis enregistree. Un
+   * device dont la mesure echoue obtient un score nul.
+   */
+  inline DeviceProbe probeDevice(const cl::Device& device)
+  {
+    char key[17];
+    FILE* file;
+    DeviceProbe probe;
+
+    std::string path;
+    std::string temporaryPath;
+    std::string directory = cacheDirectory();
+    std::string parameters;
+
+    // La source, ses options et les tailles mesurees font partie de la cle: une
+    // nouvelle mesure invalide le cache
+    parameters = probeOptions(probeTile(device)) + " " + std::to_string(probeTries) + " "
+      + std::to_string(probeCopyFloat4Count) + " " + std::to_string(probeGemmOrder);
+    snprintf(key, sizeof(key), "%016llx",
+	     (unsigned long long)fnv1a(probeSource(), fnv1a(parameters, fnv1a(deviceIdentity(device)))));
+
+    if (!directory.empty())
+    {
+      path = directory + "/probe-" + key + ".txt";
+
+      file = fopen(path.c_str(), "r");
+      if (file != NULL)
+      {
+	probe.cached = fscanf(file, "%lf %lf", &probe.gbytesPerSecond, &probe.gemmGflops) == 2;
+	fclose(file);
+
+	if (probe.cached)
+	  return probe;
+      }
+    }
+
+    try
+    {
+      probe = measureDevice(device);
+    }
+    catch (const cl::Error& e)
+    {
+      fprintf(stderr, "Mesure du device impossible (%s: %d)\r\n", e.what(), e.err());
+      return DeviceProbe();
+    }
+
+    if (path.empty())
+      return probe;
+
+    // Ecriture puis renommage: une mesure partielle n'est jamais visible
+    temporaryPath = path + "." + std::to_string(getpid());
+
+    file = fopen(temporaryPath.c_str(), "w");
+    if (file == NULL)
+      return probe;
+
+    bool written = fprintf(file, "%.3f %.3f\n", probe.gbytesPerSecond, probe.gemmGflops) > 0;
+    written = fclose(file) == 0 && written;
+
+    if (!written || rename(temporaryPath.c_str(), path.c_str()) != 0)
+      remove(temporaryPath.c_str());
+
+    return probe;
+  }
+
+  /**
+   * Indices de 'devices' du meilleur score au moins bon. 'probes' recoit les mesures
+   * dans l'ordre de 'devices'.
+   */
+  inline std::vector<size_t> rankDevices(const std::vector<cl::Device>& devices, std::vector<DeviceProbe>* probes = NULL)
+  {
+    size_t i;
+    std::vector<size_t> ranking;
+    std::vector<DeviceProbe> measured;
+
+    for (i = 0; i < devices.size(); ++i)
+    {
+      measured.push_back(probeDevice(devices[i]));
+      ranking.push_back(i);
+    }
+
+    std::stable_sort(ranking.begin(), ranking.end(),
+		     [&](size_t a, size_t b) { return measured[a].score() > measured[b].score(); });
+
+    if (probes != NULL)
+      probes->swap(measured);
+
+    return ranking;
+  }
+
+  /**
+   * Indice du device le plus rapide de 'devices' (ou KITE_DEVICE s'il est defini).
+   * Une ligne p/ device est affichee sur stderr.
+   */
+  inline size_t selectDevice(const std::vector<cl::Device>& devices)
+  {
+    size_t i;
+    size_t selected;
+    char* end;
+    unsigned long index;
+    const char* forced = getenv("KITE_DEVICE");
+
+    std::string name;
+    std::vector<size_t> ranking;
+    std::vector<DeviceProbe> probes;
+
+    if (forced != NULL && forced[0] != '\0')
+    {
+      index = strtoul(forced, &end, 10);
+      if (*end == '\0' && forced[0] != '-' && index < devices.size())
+	return index;
+
+      fprintf(stderr, "KITE_DEVICE=%s ignore: indice attendu entre 0 et %lu\r\n", forced, (unsigned long)devices.size() - 1);
+    }
+
+    ranking = rankDevices(devices, &probes);
+    selected = ranking.empty() ? 0 : ranking[0];
+
+    for (i = 0; i < devices.size(); ++i)
+    {
+      devices[i].getInfo(CL_DEVICE_NAME, &name);
+      fprintf(stderr, "%c Device [%lu] %s: %.1f GB/s, %.1f GFLOP/s (%s)\r\n", i == selected ? '*' : ' ',
+	      i, name.c_str(), probes[i].gbytesPerSecond, probes[i].gemmGflops, probes[i].cached ? "cache" : "mesure");
+    }
+
+    return selected;
+  }
+}
+
+#endif
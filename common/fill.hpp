@@ -0,0 +1,177 @@
+#ifndef KITE_FILL_HPP
+#define KITE_FILL_HPP
+
+/**
+ * Generation des operandes sur le device: zero, constante, identite, rampe et
+ * valeurs aleatoires uniformes ou normales reproductibles (graine + indice).
+ *
+ * Les buffers sont remplis sans allocation ni transfert host. Les constantes
+ * utilisent enqueueFillBuffer, les autres remplissages un kernel du programme
+ * embarque ci-dessous, construit une fois par contexte et device (Filler).
+ * Les commandes sont comptees et tracees comme des lancements de kernels.
+ */
+
+#include <cl.hpp>
+#include <counters.hpp>
+#include <programcache.hpp>
+
+#include <string>
+
+namespace kite
+{
+  inline const char* fillSource()
+  {
+    return
+      "uint fill_hash(uint x)\n"
+      "{\n"
+      "  x ^= x >> 16; x *= 0x7feb352dU;\n"
+      "  x ^= x >> 15; x *= 0x846ca68bU;\n"
+      "  x ^= x >> 16;\n"
+      "  return x;\n"
+      "}\n"
+      "\n"
+      "/* Reel uniforme dans ]0, 1] tire de (graine, indice, flux) */\n"
+      "float fill_random(uint seed, ulong i, uint stream)\n"
+      "{\n"
+      "  uint h = fill_hash(seed ^ fill_hash((uint)i ^ fill_hash((uint)(i >> 32) + stream * 0x9e3779b9U)));\n"
+      "  return ((h >> 8) + 1) * (1.0f / 16777216.0f);\n"
+      "}\n"
+      "\n"
+      "__kernel void fill_identity(const ulong row_offset, const ulong m_cols, __global float* g_m)\n"
+      "{\n"
+      "  ulong r = get_global_id(0);\n"
+      "  ulong c = get_global_id(1);\n"
+      "  g_m[r * m_cols + c] = ((row_offset + r) % m_cols == c) ? 1 : 0;\n"
+      "}\n"
+      "\n"
+      "__kernel void fill_ramp(const float start, const float step, __global float* g_m)\n"
+      "{\n"
+      "  size_t i = get_global_id(0);\n"
+      "  g_m[i] = start + i * step;\n"
+      "}\n"
+      "\n"
+      "__kernel void fill_uniform(const uint seed, const float low, const float high, __global float* g_m)\n"
+      "{\n"
+      "  size_t i = get_global_id(0);\n"
+      "  g_m[i] = low + (high - low) * fill_random(seed, i, 0);\n"
+      "}\n"
+      "\n"
+      "/* Box-Muller */\n"
+      "__kernel void fill_normal(const uint seed, const float mean, const float stddev, __global float* g_m)\n"
+      "{\n"
+      "  size_t i = get_global_id(0);\n"
+      "  float u1 = fill_random(seed, i, 0);\n"
+      "  float u2 = fill_random(seed, i, 1);\n"
+      "  g_m[i] = mean + stddev * sqrt(-2 * log(u1)) * cospi(2 * u2);\n"
+      "}\n";
+  }
+
+  /**
+   * Remplissages pour un contexte et un device. Le programme (ProgramCache) et les
+   * kernels sont crees une fois a la construction: l'objet est garde par l'appelant
+   * pour toute la duree de ses remplissages, et la construction avant une mesure
+   * evite d'y inclure la compilation. Les kernels etant partages, un Filler ne doit
+   * etre utilise que par un thread a la fois, avec des files de son device.
+   */
+  class Filler
+  {
+  public:
+
+    Filler() {}
+
+    Filler(const cl::Context& context, const cl::Device& device)
+      : _program(ProgramCache::instance().get(context, device, fillSource(), "")),
+	_identity(_program, "fill_identity"),
+	_ramp(_program, "fill_ramp"),
+	_uniform(_program, "fill_uniform"),
+	_normal(_program, "fill_normal") {}
+
+    cl::Event constant(cl::CommandQueue& queue, const cl::Buffer& buffer, size_t count, float value,
+		       const VECTOR_CLASS<cl::Event>* waitList = NULL)
+    {
+      cl::Event event;
+
+      queue.enqueueFillBuffer(buffer, value, 0, sizeof(float) * count, waitList, &event);
+
+      recordLaunch(queue, event, "fill_constant", KernelCost(0, sizeof(float) * count));
+
+      return event;
+    }
+
+    cl::Event zero(cl::CommandQueue& queue, const cl::Buffer& buffer, size_t count,
+		   const VECTOR_CLASS<cl::Event>* waitList = NULL)
+    {
+      return constant(queue, buffer, count, 0.0f, waitList);
+    }
+
+    /**
+     * Bloc de lignes [rowOffset, rowOffset + rows[ d'une matrice "identite" a 'cols'
+     * colonnes: m(r, c) = 1 si r mod cols = c, 0 sinon.
+     */
+    cl::Event identity(cl::CommandQueue& queue, const cl::Buffer& buffer, size_t rows, size_t cols,
+		       size_t rowOffset = 0, const VECTOR_CLASS<cl::Event>* waitList = NULL)
+    {
+      _identity.setArg(0, (cl_ulong)rowOffset);
+      _identity.setArg(1, (cl_ulong)cols);
+      _identity.setArg(2, buffer);
+
+      return enqueueKernel(queue, _identity, cl::NDRange(rows, cols), cl::NullRange, waitList, "fill_identity",
+			   KernelCost(0, sizeof(float) * rows * cols));
+    }
+
+    /**
+     * m[i] = start + i * step.
+     */
+    cl::Event ramp(cl::CommandQueue& queue, const cl::Buffer& buffer, size_t count, float start, float step,
+		   const VECTOR_CLASS<cl::Event>* waitList = NULL)
+    {
+      _ramp.setArg(0, start);
+      _ramp.setArg(1, step);
+      _ramp.setArg(2, buffer);
+
+      return enqueueKernel(queue, _ramp, cl::NDRange(count), cl::NullRange, waitList, "fill_ramp",
+			   KernelCost(2.0 * count, sizeof(float) * count));
+    }
+
+    /**
+     * Valeurs uniformes dans ]low, high], fonction seulement de 'seed' et de l'indice.
+     */
+    cl::Event uniform(cl::CommandQueue& queue, const cl::Buffer& buffer, size_t count, cl_uint seed,
+		      float low = 0, float high = 1, const VECTOR_CLASS<cl::Event>* waitList = NULL)
+    {
+      _uniform.setArg(0, seed);
+      _uniform.setArg(1, low);
+      _uniform.setArg(2, high);
+      _uniform.setArg(3, buffer);
+
+      return enqueueKernel(queue, _uniform, cl::NDRange(count), cl::NullRange, waitList, "fill_uniform",
+			   KernelCost(0, sizeof(float) * count));
+    }
+
+    /**
+     * Valeurs normales N(mean, stddev^2), fonction seulement de 'seed' et de l'indice.
+     */
+    cl::Event normal(cl::CommandQueue& queue, const cl::Buffer& buffer, size_t count, cl_uint seed,
+		     float mean = 0, float stddev = 1, const VECTOR_CLASS<cl::Event>* waitList = NULL)
+    {
+      _normal.setArg(0, seed);
+      _normal.setArg(1, mean);
+      _normal.setArg(2, stddev);
+      _normal.setArg(3, buffer);
+
+      return enqueueKernel(queue, _normal, cl::NDRange(count), cl::NullRange, waitList, "fill_normal",
+			   KernelCost(0, sizeof(float) * count));
+    }
+
+  private:
+
+    cl::Program _program;
+
+    cl::Kernel _identity;
+    cl::Kernel _ramp;
+    cl::Kernel _uniform;
+    cl::Kernel _normal;
+  };
+}
+
+#endif
@@ -0,0 +1,202 @@
+#ifndef KITE_FISSION_HPP
+#define KITE_FISSION_HPP
+
+/**
+ * Partitionnement ("fission") d'un device CPU en un sous-device par noeud NUMA.
+ *
+ * Un contexte cree sur CL_DEVICE_TYPE_ALL presente une machine multi-sockets
+ * comme un seul device: la memoire des buffers n'est alors pas placee sur le
+ * noeud des coeurs qui l'utilisent. Avec un sous-device et une file par noeud,
+ * chaque partition du calcul est executee et premiere touchee ("first touch")
+ * sur son noeud.
+ */
+
+#include <cl.hpp>
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+
+namespace kite
+{
+  /**
+   * Nombre de noeuds NUMA de la machine (Linux), 'fallback' si inconnu.
+   */
+  inline int numaNodeCount(int fallback = 1)
+  {
+    int count;
+    DIR* dir;
+    struct dirent* entry;
+
+    dir = opendir("/sys/devices/system/node");
+    if (dir == NULL)
+      return fallback;
+
+    count = 0;
+    while ((entry = readdir(dir)) != NULL)
+      if (strncmp(entry->d_name, "node", 4) == 0 && entry->d_name[4] >= '0' && entry->d_name[4] <= '9')
+	++count;
+
+    closedir(dir);
+
+    return count > 0 ? count : fallback;
+  }
+
+  /**
+   * Partitionne 'device' par domaine d'affinite NUMA, ou a defaut en autant de
+   * sous-devices de taille egale que de noeuds NUMA (partition "by counts").
+   * Retourne le device lui-meme si aucune partition n'est possible.
+   */
+  inline std::vector<cl::Device> createNumaSubDevices(cl::Device device)
+  {
+    size_t i;
+    int nodes;
+    cl_uint computeUnits;
+    cl_uint maxSubDevices;
+    cl_device_affinity_domain affinityDomains;
+
+    VECTOR_CLASS<cl_device_partition_property> partitionTypes;
+    std::vector<cl_device_partition_property> properties;
+    VECTOR_CLASS<cl::Device> subDevices;
+
+    device.getInfo(CL_DEVICE_MAX_COMPUTE_UNITS, &computeUnits);
+    device.getInfo(CL_DEVICE_PARTITION_MAX_SUB_DEVICES, &maxSubDevices);
+    device.getInfo(CL_DEVICE_PARTITION_PROPERTIES, &partitionTypes);
+    device.getInfo(CL_DEVICE_PARTITION_AFFINITY_DOMAIN, &affinityDomains);
+
+    if (maxSubDevices > 1)
+    {
+      if (std::find(partitionTypes.begin(), partitionTypes.end(), (cl_device_partition_property)CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN) != partitionTypes.end()
+	  && (affinityDomains & CL_DEVICE_AFFINITY_DOMAIN_NUMA) != 0)
+      {
+	properties.push_back(CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN);
+	properties.push_back(CL_DEVICE_AFFINITY_DOMAIN_NUMA);
+	properties.push_back(0);
+
+	try
+	{
+	  if (device.createSubDevices(&properties[0], &subDevices) == CL_SUCCESS && !subDevices.empty())
+	    return std::vector<cl::Device>(subDevices.begin(), subDevices.end());
+	}
+	catch (const cl::Error& e)
+	{
+	  fprintf(stderr, "Partition par domaine NUMA impossible (%s)\r\n", e.what());
+	}
+      }
+
+      nodes = std::min(numaNodeCount(), (int)std::min(maxSubDevices, computeUnits));
+
+      if (nodes > 1
+	  && std::find(partitionTypes.begin(), partitionTypes.end(), (cl_device_partition_property)CL_DEVICE_PARTITION_BY_COUNTS) != partitionTypes.end())
+      {
+	properties.clear();
+	properties.push_back(CL_DEVICE_PARTITION_BY_COUNTS);
+	for (i = 0; i < (size_t)nodes; ++i)
+	  properties.push_back(computeUnits / nodes);
+	properties.push_back(CL_DEVICE_PARTITION_BY_COUNTS_LIST_END);
+	properties.push_back(0);
+
+	subDevices.clear();
+	try
+	{
+	  if (device.createSubDevices(&properties[0], &subDevices) == CL_SUCCESS && !subDevices.empty())
+	    return std::vector<cl::Device>(subDevices.begin(), subDevices.end());
+	}
+	catch (const cl::Error& e)
+	{
+	  fprintf(stderr, "Partition par nombre d'unites de calcul impossible (%s)\r\n", e.what());
+	}
+      }
+    }
+
+    return std::vector<cl::Device>(1, device);
+  }
+
+  /**
+   * Premier device CPU de 'devices'.
+   */
+  inline bool findCpuDevice(const std::vector<cl::Device>& devices, cl::Device* cpuDevice)
+  {
+    size_t i;
+    cl_device_type type;
+
+    for (i = 0; i < devices.size(); ++i)
+    {
+      devices[i].getInfo(CL_DEVICE_TYPE, &type);
+      if ((type & CL_DEVICE_TYPE_CPU) != 0)
+      {
+	*cpuDevice = devices[i];
+	return true;
+      }
+    }
+
+    return false;
+  }
+
+  inline void printSubDevices(const std::vector<cl::Device>& subDevices)
+  {
+    size_t i;
+
+    printf("%lu sous-device(s):\r\n", subDevices.size());
+    for (i = 0; i < subDevices.size(); ++i)
+      printf("  Sous-device[%lu]: %u unites de calcul\r\n", i, (cl_uint)subDevices[i].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>());
+    printf("\r\n");
+  }
+
+  /**
+   * Intervalle [*begin, *begin + *count[ de la partie 'part' de 'total' elements
+   * repartis en 'parts' parties.
+   */
+  inline void splitRange(size_t total, int parts, int part, size_t* begin, size_t* count)
+  {
+    size_t base = total / parts;
+    size_t remainder = total % parts;
+
+    *begin = part * base + std::min((size_t)part, remainder);
+    *count = base + ((size_t)part < remainder ? 1 : 0);
+  }
+
+  /**
+   * Execution partitionnee sur 'subDevices' d'un probleme de taille 'problemSize'.
+   * Retourne la duree en secondes.
+   */
+  typedef std::function<double (const std::vector<cl::Device>& subDevices, size_t problemSize)> PartitionedRun;
+
+  /**
+   * Mesure du passage a l'echelle sur 1..N sous-devices: probleme de taille fixe
+   * ("strong scaling") ou proportionnelle au nombre de sous-devices ("weak scaling").
+   */
+  inline void runScaling(const std::vector<cl::Device>& subDevices, size_t baseProblemSize, bool weak, const PartitionedRun& run)
+  {
+    size_t count;
+    size_t problemSize;
+    double seconds;
+    double referenceSeconds;
+
+    printf("---------- %s scaling ----------\r\n", weak ? "Weak" : "Strong");
+    printf("\r\n");
+    printf("%12s %14s %12s %10s %10s\r\n", "Sous-devices", "Taille", "Temps (ms)", "Speedup", "Efficacite");
+
+    referenceSeconds = 0;
+    for (count = 1; count <= subDevices.size(); ++count)
+    {
+      problemSize = weak ? baseProblemSize * count : baseProblemSize;
+
+      seconds = run(std::vector<cl::Device>(subDevices.begin(), subDevices.begin() + count), problemSize);
+      if (count == 1)
+	referenceSeconds = seconds;
+
+      // Weak scaling: speedup mesure a travail par sous-device constant
+      double speedup = weak ? referenceSeconds * count / seconds : referenceSeconds / seconds;
+
+      printf("%12lu %14lu %12.3f %10.2f %9.1f%%\r\n", count, problemSize, seconds * 1e3, speedup, 100.0 * speedup / count);
+    }
+    printf("\r\n");
+  }
+}
+
+#endif
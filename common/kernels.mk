@@ -0,0 +1,30 @@
+# Embarquement des kernels OpenCL dans les executables.
+#
+# Pour chaque fichier de kernels x.cl:
+#  - x.cl.inc: source sous forme de chaine C++ brute (R"...")
+#  - x.spv.inc: octets du module SPIR-V compile hors ligne avec "make SPIRV=1",
+#    vide sinon (le programme est alors compile a partir des sources)
+#
+# Apres un changement de SPIRV, faire "make clean".
+
+SPIRV ?= 0
+SPIRV_CLANG ?= clang
+SPIRV_LLVM_SPIRV ?= llvm-spirv
+SPIRV_CLFLAGS ?= -cl-std=CL1.2 -O2 -Xclang -finclude-default-header
+
+.SECONDARY:
+
+%.cl.inc: %.cl
+	( printf 'R"KITE_CL('; cat $<; printf ')KITE_CL"\n' ) > $@
+
+ifeq ($(SPIRV), 1)
+%.spv: %.cl
+	$(SPIRV_CLANG) -c -x cl $(SPIRV_CLFLAGS) -target spir64 -emit-llvm -o $*.bc $<
+	$(SPIRV_LLVM_SPIRV) $*.bc -o $@
+
+%.spv.inc: %.spv
+	od -An -v -tx1 $< | sed 's/\([0-9a-f][0-9a-f]\)/0x\1,/g' > $@
+else
+%.spv.inc: %.cl
+	: > $@
+endif
@@ -0,0 +1,263 @@
+#ifndef KITE_MATRIXFILE_HPP
+#define KITE_MATRIXFILE_HPP
+
+/**
+ * Format binaire de matrices (.kmat) lu et ecrit par projection memoire (mmap).
+ *
+ * Un en-tete de 64 octets (dimensions, type, disposition, alignement) precede les
+ * donnees, qui commencent a un decalage multiple de l'alignement. Les transferts
+ * vers et depuis le device se font par blocs directement depuis la projection,
+ * sans copie intermediaire dans un std::vector.
+ */
+
+#include <cl.hpp>
+#include <counters.hpp>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace kite
+{
+  enum MatrixDataType
+  {
+    MATRIX_FLOAT32 = 1,
+    MATRIX_FLOAT64 = 2
+  };
+
+  enum MatrixLayout
+  {
+    MATRIX_ROW_MAJOR = 0,
+    MATRIX_COLUMN_MAJOR = 1
+  };
+
+  struct MatrixFileHeader
+  {
+    char magic[4];		// "KMAT"
+    uint32_t version;		// 1
+    uint32_t dataType;		// MatrixDataType
+    uint32_t layout;		// MatrixLayout
+    uint64_t rows;
+    uint64_t cols;
+    uint64_t alignment;		// Alignement des donnees en octets
+    uint64_t dataOffset;	// Decalage des donnees depuis le debut du fichier
+    uint64_t reserved[2];
+  };
+
+  static_assert(sizeof(MatrixFileHeader) == 64, "MatrixFileHeader doit faire 64 octets");
+
+  inline size_t matrixDataTypeSize(uint32_t dataType)
+  {
+    switch (dataType)
+    {
+    case MATRIX_FLOAT32: return 4;
+    case MATRIX_FLOAT64: return 8;
+    default: return 0;
+    }
+  }
+
+  /**
+   * Taille des donnees d'une matrice 'rows' x 'cols'. Faux si une dimension est
+   * nulle, si le type est inconnu ou si la taille ne tient pas dans un size_t.
+   */
+  inline bool matrixDataBytes(uint64_t rows, uint64_t cols, uint32_t dataType, size_t* bytes)
+  {
+    size_t size = matrixDataTypeSize(dataType);
+
+    if (rows == 0 || cols == 0 || size == 0)
+      return false;
+    if (rows > SIZE_MAX / cols || rows * cols > SIZE_MAX / size)
+      return false;
+
+    *bytes = rows * cols * size;
+    return true;
+  }
+
+  class MatrixFile
+  {
+  public:
+
+    MatrixFile() : _fd(-1), _mapping(NULL), _mappingSize(0), _writable(false) {}
+    ~MatrixFile() { close(); }
+
+    // Une copie libererait deux fois la projection
+    MatrixFile(const MatrixFile&) = delete;
+    MatrixFile& operator=(const MatrixFile&) = delete;
+
+    /**
+     * Projection en lecture seule d'un fichier existant.
+     */
+    bool open(const std::string& path)
+    {
+      size_t bytes;
+      struct stat status;
+
+      close();
+
+      _fd = ::open(path.c_str(), O_RDONLY);
+      if (_fd < 0 || fstat(_fd, &status) != 0 || (size_t)status.st_size < sizeof(MatrixFileHeader))
+	return fail("impossible d'ouvrir", path);
+
+      _mappingSize = status.st_size;
+      _mapping = mmap(NULL, _mappingSize, PROT_READ, MAP_SHARED, _fd, 0);
+      if (_mapping == MAP_FAILED)
+      {
+	_mapping = NULL;
+	return fail("impossible de projeter", path);
+      }
+
+      const MatrixFileHeader& h = header();
+      if (memcmp(h.magic, "KMAT", 4) != 0 || h.version != 1 || !matrixDataBytes(h.rows, h.cols, h.dataType, &bytes)
+	  || h.dataOffset < sizeof(MatrixFileHeader) || h.dataOffset > _mappingSize || bytes > _mappingSize - h.dataOffset)
+	return fail("en-tete invalide", path);
+
+      // Lecture sequentielle pendant l'envoi par blocs
+      madvise(_mapping, _mappingSize, MADV_SEQUENTIAL);
+
+      return true;
+    }
+
+    /**
+     * Creation d'un fichier de 'rows' x 'cols' elements projete en lecture/ecriture.
+     * Les dimensions et l'alignement doivent etre non nuls.
+     */
+    bool create(const std::string& path, uint64_t rows, uint64_t cols,
+		MatrixDataType dataType = MATRIX_FLOAT32, MatrixLayout layout = MATRIX_ROW_MAJOR,
+		uint64_t alignment = 4096)
+    {
+      size_t bytes;
+      MatrixFileHeader h;
+
+      close();
+
+      if (alignment == 0 || alignment > SIZE_MAX / 2 || !matrixDataBytes(rows, cols, dataType, &bytes))
+	return fail("dimensions ou alignement invalides pour", path);
+
+      memset(&h, 0, sizeof(h));
+      memcpy(h.magic, "KMAT", 4);
+      h.version = 1;
+      h.dataType = dataType;
+      h.layout = layout;
+      h.rows = rows;
+      h.cols = cols;
+      h.alignment = alignment;
+      h.dataOffset = ((sizeof(h) + alignment - 1) / alignment) * alignment;
+
+      if (bytes > SIZE_MAX - h.dataOffset)
+	return fail("taille trop grande pour", path);
+
+      _mappingSize = h.dataOffset + bytes;
+
+      _fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+      if (_fd < 0 || ftruncate(_fd, _mappingSize) != 0)
+	return fail("impossible de creer", path);
+
+      _mapping = mmap(NULL, _mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+      if (_mapping == MAP_FAILED)
+      {
+	_mapping = NULL;
+	return fail("impossible de projeter", path);
+      }
+
+      _writable = true;
+      memcpy(_mapping, &h, sizeof(h));
+
+      return true;
+    }
+
+    void close()
+    {
+      if (_mapping != NULL)
+      {
+	if (_writable)
+	  msync(_mapping, _mappingSize, MS_SYNC);
+	munmap(_mapping, _mappingSize);
+      }
+      if (_fd >= 0)
+	::close(_fd);
+
+      _fd = -1;
+      _mapping = NULL;
+      _mappingSize = 0;
+      _writable = false;
+    }
+
+    const MatrixFileHeader& header() const { return *(const MatrixFileHeader*)_mapping; }
+
+    size_t dataBytes() const { return header().rows * header().cols * matrixDataTypeSize(header().dataType); }
+
+    const char* data() const { return (const char*)_mapping + header().dataOffset; }
+    char* data() { return (char*)_mapping + header().dataOffset; }
+
+    /**
+     * Envoi des donnees dans 'buffer' par blocs de 'chunkBytes' octets lus
+     * directement dans la projection. Retourne un evenement marquant la fin de
+     * tous les blocs; le fichier doit rester ouvert jusque-la.
+     */
+    cl::Event upload(cl::CommandQueue& queue, const cl::Buffer& buffer, size_t chunkBytes, const std::string& name) const
+    {
+      size_t offset;
+      size_t size;
+
+      cl::Event marker;
+      VECTOR_CLASS<cl::Event> chunks;
+
+      for (offset = 0; offset < dataBytes(); offset += size)
+      {
+	size = std::min(chunkBytes, dataBytes() - offset);
+	chunks.push_back(enqueueWrite(queue, buffer, offset, size, data() + offset, NULL, name));
+      }
+
+      queue.enqueueMarkerWithWaitList(&chunks, &marker);
+
+      return marker;
+    }
+
+    /**
+     * Lecture de 'buffer' par blocs directement dans la projection, apres
+     * 'waitList'. Les donnees sont ecrites sur disque a la fermeture (msync).
+     */
+    cl::Event download(cl::CommandQueue& queue, const cl::Buffer& buffer, size_t chunkBytes,
+		       const VECTOR_CLASS<cl::Event>* waitList, const std::string& name)
+    {
+      size_t offset;
+      size_t size;
+
+      cl::Event marker;
+      VECTOR_CLASS<cl::Event> chunks;
+
+      for (offset = 0; offset < dataBytes(); offset += size)
+      {
+	size = std::min(chunkBytes, dataBytes() - offset);
+	chunks.push_back(enqueueRead(queue, buffer, offset, size, data() + offset, waitList, name));
+      }
+
+      queue.enqueueMarkerWithWaitList(&chunks, &marker);
+
+      return marker;
+    }
+
+  private:
+
+    bool fail(const char* message, const std::string& path)
+    {
+      fprintf(stderr, "kite::MatrixFile: %s '%s'\r\n", message, path.c_str());
+      close();
+      return false;
+    }
+
+    int _fd;
+    void* _mapping;
+    size_t _mappingSize;
+    bool _writable;
+  };
+}
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef KITE_PROGRAM_HPP
+#define KITE_PROGRAM_HPP
+
+/**
+ * Construction des programmes OpenCL a partir des sources embarquees dans
+ * l'executable (fichiers .cl.inc generes par les Makefiles), ou du module
+ * SPIR-V compile hors ligne (.spv.inc, "make SPIRV=1") quand tous les devices
+ * supportent cl_khr_il_program.
+ */
+
+#include <cl.hpp>
+
+#include <string>
+#include <vector>
+#include <cstdio>
+
+namespace kite
+{
+  struct ProgramSource
+  {
+    const char* name;			// Nom du fichier .cl d'origine
+    const char* source;
+    const unsigned char* spirv;		// Module SPIR-V, NULL ou vide si non compile
+    size_t spirvSize;
+  };
+
+  typedef cl_program (*clCreateProgramWithILKHR_fn)(cl_context context, const void* il, size_t length, cl_int* errcode_ret);
+
+  inline bool supportsExtension(const cl::Device& device, const char* extension)
+  {
+    std::string extensions;
+
+    device.getInfo(CL_DEVICE_EXTENSIONS, &extensions);
+
+    return (" " + extensions + " ").find(" " + std::string(extension) + " ") != std::string::npos;
+  }
+
+  inline void printBuildLogs(const cl::Program& program, const std::vector<cl::Device>& devices)
+  {
+    size_t i;
+    std::string log;
+
+    for (i = 0; i < devices.size(); ++i)
+    {
+      program.getBuildInfo(devices[i], CL_PROGRAM_BUILD_LOG, &log);
+      fprintf(stderr, "\r\n%s\r\n", log.c_str());
+    }
+  }
+
+  /**
+   * Programme construit a partir du module SPIR-V, ou programme nul si le module
+   * est absent, si un device ne supporte pas cl_khr_il_program, ou si sa
+   * construction echoue.
+   */
+  inline cl::Program buildProgramFromIL(const cl::Context& context, const std::vector<cl::Device>& devices,
+					const ProgramSource& source, const std::string& options)
+  {
+    size_t i;
+    cl_int error;
+    cl_program object;
+    cl_platform_id platform;
+    clCreateProgramWithILKHR_fn createProgramWithIL;
+
+    if (source.spirv == NULL || source.spirvSize == 0 || devices.empty())
+      return cl::Program();
+
+    for (i = 0; i < devices.size(); ++i)
+      if (!supportsExtension(devices[i], "cl_khr_il_program"))
+	return cl::Program();
+
+    devices[0].getInfo(CL_DEVICE_PLATFORM, &platform);
+    createProgramWithIL = (clCreateProgramWithILKHR_fn)clGetExtensionFunctionAddressForPlatform(platform, "clCreateProgramWithILKHR");
+    if (createProgramWithIL == NULL)
+      return cl::Program();
+
+    object = createProgramWithIL(context(), source.spirv, source.spirvSize, &error);
+    if (error != CL_SUCCESS)
+      return cl::Program();
+
+    cl::Program program(object);
+
+    try
+    {
+      program.build(devices, options.c_str());
+    }
+    catch (const cl::Error& e)
+    {
+      fprintf(stderr, "Module SPIR-V de '%s' refuse (%s), compilation des sources\r\n", source.name, e.what());
+      return cl::Program();
+    }
+
+    return program;
+  }
+
+  /**
+   * Construit 'source' pour 'devices'. En cas d'echec, les journaux de
+   * compilation sont affiches et l'exception cl::Error est propagee.
+   */
+  inline cl::Program buildProgram(const cl::Context& context, const std::vector<cl::Device>& devices,
+				  const ProgramSource& source, const std::string& options = "", bool* fromIL = NULL)
+  {
+    cl::Program program;
+
+    program = buildProgramFromIL(context, devices, source, options);
+    if (fromIL != NULL)
+      *fromIL = program() != NULL;
+    if (program() != NULL)
+      return program;
+
+    program = cl::Program(context, std::string(source.source));
+
+    try
+    {
+      program.build(devices, options.c_str());
+    }
+    catch (const cl::Error&)
+    {
+      printBuildLogs(program, devices);
+      throw;
+    }
+
+    return program;
+  }
+}
+
+#endif
@@ -0,0 +1,262 @@
+#ifndef KITE_PROGRAMCACHE_HPP
+#define KITE_PROGRAMCACHE_HPP
+
+/**
+ * Cache des programmes compiles a l'execution (sources generees, options -D).
+ *
+ * Un programme est identifie par le device (nom, vendeur, versions du device et
+ * du pilote), les options de compilation et la source. Il est conserve en memoire
+ * pour la duree du processus, et son binaire est enregistre sur disque dans
+ * $KITE_CACHE_DIR (par defaut ~/.cache/kite) pour les executions suivantes.
+ */
+
+#include <cl.hpp>
+#include <program.hpp>
+#include <trace.hpp>
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace kite
+{
+  /**
+   * Empreinte FNV-1a 64 bits, stable d'une execution et d'une plateforme a l'autre.
+   */
+  inline uint64_t fnv1a(const std::string& data, uint64_t hash = 14695981039346656037ULL)
+  {
+    size_t i;
+
+    for (i = 0; i < data.size(); ++i)
+    {
+      hash ^= (unsigned char)data[i];
+      hash *= 1099511628211ULL;
+    }
+
+    return hash;
+  }
+
+  /**
+   * Identite d'un device et de son pilote: un binaire ou une mesure n'est valable
+   * que pour la meme identite.
+   */
+  inline std::string deviceIdentity(const cl::Device& device)
+  {
+    std::string name;
+    std::string vendor;
+    std::string version;
+    std::string driverVersion;
+
+    device.getInfo(CL_DEVICE_NAME, &name);
+    device.getInfo(CL_DEVICE_VENDOR, &vendor);
+    device.getInfo(CL_DEVICE_VERSION, &version);
+    device.getInfo(CL_DRIVER_VERSION, &driverVersion);
+
+    return name + "|" + vendor + "|" + version + "|" + driverVersion;
+  }
+
+  /**
+   * Repertoire du cache disque, cree si besoin. Chaine vide si indisponible.
+   */
+  inline std::string cacheDirectory()
+  {
+    const char* dir = getenv("KITE_CACHE_DIR");
+    const char* home = getenv("HOME");
+
+    std::string path;
+
+    if (dir != NULL && dir[0] != '\0')
+      path = dir;
+    else if (home != NULL && home[0] != '\0')
+    {
+      path = std::string(home) + "/.cache";
+      mkdir(path.c_str(), 0755);
+      path += "/kite";
+    }
+    else
+      return "";
+
+    mkdir(path.c_str(), 0755);
+
+    return access(path.c_str(), W_OK) == 0 ? path : "";
+  }
+
+  class ProgramCache
+  {
+  public:
+
+    static ProgramCache& instance()
+    {
+      static ProgramCache cache;
+      return cache;
+    }
+
+    /**
+     * Programme 'source' construit pour 'device' avec 'options': depuis la memoire,
+     * sinon depuis le binaire sur disque, sinon compile puis enregistre. Les echecs
+     * de compilation sont propages (cl::Error) apres affichage des journaux.
+     */
+    cl::Program get(const cl::Context& context, const cl::Device& device,
+		    const std::string& source, const std::string& options)
+    {
+      char key[17];
+      std::string path;
+      std::string directory;
+      std::vector<cl::Device> devices(1, device);
+
+      std::map<std::string, cl::Program>::const_iterator it;
+
+      // Compilations serialisees: un programme demande par plusieurs threads n'est construit qu'une fois
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      snprintf(key, sizeof(key), "%016llx",
+	       (unsigned long long)fnv1a(source, fnv1a(options, fnv1a(deviceIdentity(device)))));
+
+      // Un programme n'est utilisable que dans son contexte, et pour le device
+      // pour lequel il a ete construit: des sous-devices d'un meme contexte ont la
+      // meme identite (nom, pilote) mais chacun son programme
+      std::string memoryKey = std::string(key) + "@" + std::to_string((size_t)context())
+	+ "/" + std::to_string((size_t)device());
+
+      it = _programs.find(memoryKey);
+      if (it != _programs.end())
+      {
+	++_memoryHits;
+	return it->second;
+      }
+
+      TraceSpan span(std::string("Build ") + key);
+
+      cl::Program program;
+
+      directory = cacheDirectory();
+      if (!directory.empty())
+      {
+	path = directory + "/" + key + ".bin";
+	program = loadBinary(context, device, path, options);
+      }
+
+      if (program() != NULL)
+	++_diskHits;
+      else
+      {
+	ProgramSource programSource = { key, source.c_str(), NULL, 0 };
+
+	program = buildProgram(context, devices, programSource, options);
+	++_builds;
+
+	if (!path.empty())
+	  saveBinary(program, path);
+      }
+
+      _programs[memoryKey] = program;
+
+      return program;
+    }
+
+    void printStats() const
+    {
+      printf("Cache de programmes: %lu compilation(s), %lu binaire(s) charge(s), %lu reutilisation(s)\r\n",
+	     _builds, _diskHits, _memoryHits);
+    }
+
+  private:
+
+    ProgramCache() : _builds(0), _diskHits(0), _memoryHits(0) {}
+
+    /**
+     * Programme construit a partir du binaire 'path', ou programme nul si le
+     * binaire est absent ou refuse par le pilote.
+     */
+    cl::Program loadBinary(const cl::Context& context, const cl::Device& device,
+			   const std::string& path, const std::string& options)
+    {
+      long size;
+      FILE* file;
+      std::vector<char> binary;
+
+      file = fopen(path.c_str(), "rb");
+      if (file == NULL)
+	return cl::Program();
+
+      fseek(file, 0, SEEK_END);
+      size = ftell(file);
+      fseek(file, 0, SEEK_SET);
+
+      if (size > 0)
+      {
+	binary.resize(size);
+	if (fread(&binary[0], 1, size, file) != (size_t)size)
+	  binary.clear();
+      }
+      fclose(file);
+
+      if (binary.empty())
+	return cl::Program();
+
+      try
+      {
+	std::vector<cl::Device> devices(1, device);
+	cl::Program::Binaries binaries(1, std::make_pair((const void*)&binary[0], binary.size()));
+
+	cl::Program program(context, devices, binaries);
+	program.build(devices, options.c_str());
+
+	return program;
+      }
+      catch (const cl::Error& e)
+      {
+	fprintf(stderr, "Binaire '%s' refuse (%s), compilation des sources\r\n", path.c_str(), e.what());
+	return cl::Program();
+      }
+    }
+
+    void saveBinary(const cl::Program& program, const std::string& path)
+    {
+      size_t size;
+      unsigned char* binary;
+      std::vector<unsigned char> data;
+
+      FILE* file;
+      std::string temporaryPath;
+
+      // Programme construit pour un seul device: un seul binaire
+      if (clGetProgramInfo(program(), CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL) != CL_SUCCESS || size == 0)
+	return;
+
+      data.resize(size);
+      binary = &data[0];
+      if (clGetProgramInfo(program(), CL_PROGRAM_BINARIES, sizeof(binary), &binary, NULL) != CL_SUCCESS)
+	return;
+
+      // Ecriture puis renommage: un binaire partiel n'est jamais visible
+      temporaryPath = path + "." + std::to_string(getpid());
+
+      file = fopen(temporaryPath.c_str(), "wb");
+      if (file == NULL)
+	return;
+
+      bool written = fwrite(binary, 1, size, file) == size;
+      fclose(file);
+
+      if (!written || rename(temporaryPath.c_str(), path.c_str()) != 0)
+	remove(temporaryPath.c_str());
+    }
+
+    std::map<std::string, cl::Program> _programs;
+
+    unsigned long _builds;
+    unsigned long _diskHits;
+    unsigned long _memoryHits;
+
+    std::mutex _mutex;
+  };
+}
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef KITE_SUBMISSION_HPP
+#define KITE_SUBMISSION_HPP
+
+/**
+ * Soumission de commandes depuis plusieurs threads host sur un contexte partage.
+ *
+ * Le contexte et les programmes construits sont partages par tous les threads.
+ * Chaque thread obtient son propre espace de soumission (Worker): une file de
+ * commandes et ses propres cl::Kernel, crees a la premiere demande et liberes par
+ * release() (ou a la fin d'un Submitter::Scope) avant la fin du thread. clSetKernelArg
+ * n'etant pas sur pour un meme kernel utilise par plusieurs threads, un kernel
+ * n'est jamais partage entre threads.
+ */
+
+#include <cl.hpp>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+namespace kite
+{
+  class Submitter
+  {
+  public:
+
+    /**
+     * Espace de soumission d'un thread. Ne doit etre utilise que par ce thread.
+     */
+    class Worker
+    {
+    public:
+
+      Worker(const cl::Context& context, const cl::Device& device, cl_command_queue_properties properties)
+	: _queue(context, device, properties) {}
+
+      cl::CommandQueue& queue() { return _queue; }
+
+      /**
+       * Kernel 'name' de 'program' propre a ce thread.
+       */
+      cl::Kernel& kernel(const cl::Program& program, const std::string& name)
+      {
+	std::pair<cl_program, std::string> key(program(), name);
+	std::map<std::pair<cl_program, std::string>, cl::Kernel>::iterator it;
+
+	it = _kernels.find(key);
+	if (it == _kernels.end())
+	  it = _kernels.insert(std::make_pair(key, cl::Kernel(program, name.c_str()))).first;
+
+	return it->second;
+      }
+
+    private:
+
+      cl::CommandQueue _queue;
+      std::map<std::pair<cl_program, std::string>, cl::Kernel> _kernels;
+    };
+
+    Submitter(const cl::Context& context, const cl::Device& device,
+	      cl_command_queue_properties properties = CL_QUEUE_PROFILING_ENABLE)
+      : _context(context), _device(device), _properties(properties) {}
+
+    const cl::Context& context() const { return _context; }
+    const cl::Device& device() const { return _device; }
+
+    /**
+     * Espace de soumission du thread appelant, cree a son premier appel.
+     */
+    Worker& worker()
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      std::unique_ptr<Worker>& worker = _workers[std::this_thread::get_id()];
+      if (!worker)
+	worker.reset(new Worker(_context, _device, _properties));
+
+      return *worker;
+    }
+
+    /**
+     * Liberation de l'espace de soumission du thread appelant, a faire avant sa fin:
+     * l'identifiant d'un thread termine peut etre reutilise par un nouveau thread.
+     * Les commandes soumises doivent etre terminees.
+     */
+    void release()
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      _workers.erase(std::this_thread::get_id());
+    }
+
+    /**
+     * Espace de soumission du thread courant, libere a la destruction (y compris
+     * sur exception).
+     */
+    class Scope
+    {
+    public:
+
+      Scope(Submitter& submitter) : _submitter(submitter), _worker(submitter.worker()) {}
+      ~Scope() { _submitter.release(); }
+
+      Scope(const Scope&) = delete;
+      Scope& operator=(const Scope&) = delete;
+
+      Worker& worker() { return _worker; }
+
+    private:
+
+      Submitter& _submitter;
+      Worker& _worker;
+    };
+
+    size_t workerCount()
+    {
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      return _workers.size();
+    }
+
+  private:
+
+    cl::Context _context;
+    cl::Device _device;
+    cl_command_queue_properties _properties;
+
+    std::mutex _mutex;
+    std::map<std::thread::id, std::unique_ptr<Worker> > _workers;
+  };
+}
+
+#endif
@@ -0,0 +1,212 @@
+#ifndef KITE_TASKGRAPH_HPP
+#define KITE_TASKGRAPH_HPP
+
+/**
+ * Ordonnancement d'un graphe de taches OpenCL.
+ *
+ * Les taches sont soumises a une file "out of order" et leurs dependances ne
+ * sont exprimees que par les listes d'evenements d'attente: deux taches sans
+ * dependance peuvent donc s'executer simultanement sur le device. Si le device
+ * ne supporte pas CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, les taches sont
+ * reparties sur plusieurs files "in order".
+ *
+ * Les taches soumettent leurs commandes via kite::enqueueWrite/Read/Kernel
+ * (counters.hpp) pour qu'elles soient comptees et tracees.
+ */
+
+#include <cl.hpp>
+
+#include <string>
+#include <vector>
+#include <utility>
+#include <algorithm>
+#include <functional>
+#include <cstdio>
+
+namespace kite
+{
+  class TaskGraph
+  {
+  public:
+
+    /**
+     * Soumet la commande d'une tache dans 'queue' en attendant 'waitList', et
+     * retourne l'evenement de la commande.
+     */
+    typedef std::function<cl::Event (cl::CommandQueue& queue, const VECTOR_CLASS<cl::Event>& waitList)> Submit;
+
+    TaskGraph(const cl::Context& context, const cl::Device& device,
+	      bool serialize = false, int fallbackQueueCount = 4)
+      : _serialize(serialize), _nextQueue(0)
+    {
+      int i;
+      cl_command_queue_properties properties;
+
+      device.getInfo(CL_DEVICE_QUEUE_PROPERTIES, &properties);
+
+      _outOfOrder = (properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE) != 0;
+
+      if (_outOfOrder)
+	_queues.push_back(cl::CommandQueue(context, device, CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE | CL_QUEUE_PROFILING_ENABLE));
+      else
+	for (i = 0; i < fallbackQueueCount; ++i)
+	  _queues.push_back(cl::CommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE));
+    }
+
+    bool outOfOrder() const { return _outOfOrder; }
+
+    /**
+     * Ajoute une tache. Les dependances designent des taches deja ajoutees, ce
+     * qui garantit que l'ordre d'ajout est un ordre topologique.
+     */
+    int add(const std::string& name, const char* category, const Submit& submit,
+	    const std::vector<int>& dependencies = std::vector<int>())
+    {
+      Task task;
+
+      task.name = name;
+      task.category = category;
+      task.submit = submit;
+      task.dependencies = dependencies;
+
+      if (_serialize && !_tasks.empty())
+	task.dependencies.push_back(_tasks.size() - 1);
+
+      _tasks.push_back(task);
+
+      return _tasks.size() - 1;
+    }
+
+    /**
+     * Soumet toutes les taches non encore soumises puis attend leur fin.
+     */
+    void run()
+    {
+      size_t i;
+      size_t j;
+
+      VECTOR_CLASS<cl::Event> waitList;
+
+      for (i = 0; i < _tasks.size(); ++i)
+      {
+	Task& task = _tasks[i];
+
+	if (task.submitted)
+	  continue;
+
+	waitList.clear();
+	for (j = 0; j < task.dependencies.size(); ++j)
+	  waitList.push_back(_tasks[task.dependencies[j]].event);
+
+	cl::CommandQueue& queue = nextQueue();
+
+	task.event = task.submit(queue, waitList);
+	task.submitted = true;
+      }
+
+      for (i = 0; i < _queues.size(); ++i)
+	_queues[i].flush();
+      for (i = 0; i < _queues.size(); ++i)
+	_queues[i].finish();
+    }
+
+    const cl::Event& event(int task) const { return _tasks[task].event; }
+
+    /**
+     * Duree d'execution device d'une tache terminee, en microsecondes.
+     */
+    double durationUs(int task) const
+    {
+      const cl::Event& e = _tasks[task].event;
+
+      return (e.getProfilingInfo<CL_PROFILING_COMMAND_END>() - e.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-3;
+    }
+
+    /**
+     * Affiche la concurrence obtenue: somme des durees des taches rapportee a la
+     * duree totale du graphe, et nombre maximum de taches simultanees.
+     */
+    void printConcurrencyReport() const
+    {
+      size_t i;
+
+      int running;
+      int maxRunning;
+
+      cl_ulong first;
+      cl_ulong last;
+      double busyUs;
+
+      std::vector<std::pair<cl_ulong, int> > edges;
+
+      if (_tasks.empty())
+	return;
+
+      busyUs = 0;
+      for (i = 0; i < _tasks.size(); ++i)
+      {
+	cl_ulong start = _tasks[i].event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+	cl_ulong end = _tasks[i].event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+
+	edges.push_back(std::make_pair(start, 1));
+	edges.push_back(std::make_pair(end, -1));
+
+	busyUs += (end - start) * 1e-3;
+      }
+
+      // Les fins precedent les debuts a date egale
+      std::sort(edges.begin(), edges.end());
+
+      first = edges.front().first;
+      last = edges.back().first;
+
+      running = 0;
+      maxRunning = 0;
+      for (i = 0; i < edges.size(); ++i)
+      {
+	running += edges[i].second;
+	maxRunning = std::max(maxRunning, running);
+      }
+
+      printf("Graphe: %lu taches, %s (%lu file(s))\r\n", _tasks.size(),
+	     _outOfOrder ? "file out of order" : "files in order", _queues.size());
+      printf("Duree totale: %.0f us, duree cumulee des taches: %.0f us\r\n", (last - first) * 1e-3, busyUs);
+      printf("Concurrence moyenne: %.2f, maximum: %d taches simultanees\r\n",
+	     last > first ? busyUs / ((last - first) * 1e-3) : 1.0, maxRunning);
+    }
+
+  private:
+
+    struct Task
+    {
+      Task() : category(""), submitted(false) {}
+
+      std::string name;
+      const char* category;
+      Submit submit;
+      std::vector<int> dependencies;
+
+      cl::Event event;
+      bool submitted;
+    };
+
+    cl::CommandQueue& nextQueue()
+    {
+      cl::CommandQueue& queue = _queues[_nextQueue];
+
+      _nextQueue = (_nextQueue + 1) % _queues.size();
+
+      return queue;
+    }
+
+    bool _outOfOrder;
+    bool _serialize;
+
+    std::vector<cl::CommandQueue> _queues;
+    size_t _nextQueue;
+
+    std::vector<Task> _tasks;
+  };
+}
+
+#endif
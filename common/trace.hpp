@@ -0,0 +1,289 @@
+#ifndef KITE_TRACE_HPP
+#define KITE_TRACE_HPP
+
+/**
+ * Enregistrement d'une trace chronologique de l'activite host/device au format
+ * Chrome trace (chrome://tracing, https://ui.perfetto.dev).
+ *
+ * La trace est activee en definissant la variable d'environnement KITE_TRACE
+ * avec le chemin du fichier JSON a produire. Les files de commandes doivent etre
+ * creees avec CL_QUEUE_PROFILING_ENABLE pour que les commandes soient datees.
+ *
+ * Les enregistrements peuvent etre faits depuis plusieurs threads host.
+ */
+
+#include <cl.hpp>
+
+#include <map>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <mutex>
+#include <cstdio>
+#include <cstdlib>
+
+namespace kite
+{
+  class Trace
+  {
+  public:
+
+    static Trace& instance()
+    {
+      static Trace trace;
+      return trace;
+    }
+
+    bool enabled() const { return !_path.empty(); }
+
+    /**
+     * Horloge host commune a toute la trace, en microsecondes.
+     */
+    double nowUs() const
+    {
+      return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - _origin).count();
+    }
+
+    /**
+     * Enregistre une commande OpenCL qui vient d'etre soumise a la file 'queue'.
+     * Les dates de profilage sont lues a l'ecriture de la trace.
+     */
+    void recordCommand(const cl::CommandQueue& queue, const cl::Event& event,
+		       const std::string& name, const char* category)
+    {
+      if (!enabled())
+	return;
+
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      PendingCommand command;
+
+      command.name = name;
+      command.category = category;
+      command.event = event;
+      command.hostEnqueueUs = nowUs();
+      command.queueId = queueId(queue, &command.deviceId);
+
+      _commands.push_back(command);
+    }
+
+    /**
+     * Enregistre un intervalle host [beginUs, endUs].
+     */
+    void recordHostSpan(const std::string& name, const char* category, double beginUs, double endUs)
+    {
+      if (!enabled())
+	return;
+
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      _events.push_back(Event(name, category, 0, 0, beginUs, endUs - beginUs));
+    }
+
+    /**
+     * Attend la fin des commandes enregistrees puis ecrit le fichier JSON.
+     */
+    bool write()
+    {
+      size_t i;
+      FILE* file;
+
+      if (!enabled())
+	return true;
+
+      std::lock_guard<std::mutex> lock(_mutex);
+
+      resolveCommands();
+
+      file = fopen(_path.c_str(), "w");
+      if (file == NULL)
+      {
+	fprintf(stderr, "kite::Trace: impossible d'ecrire '%s'\r\n", _path.c_str());
+	return false;
+      }
+
+      fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+      fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"tid\":0,\"args\":{\"name\":\"Host\"}}");
+      for (i = 0; i < _deviceNames.size(); ++i)
+	fprintf(file, ",\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%lu,\"tid\":0,\"args\":{\"name\":\"Device[%lu] %s\"}}",
+		i + 1, i, escape(_deviceNames[i]).c_str());
+      for (i = 0; i < _queueDevices.size(); ++i)
+	fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%lu,\"args\":{\"name\":\"Queue[%lu]\"}}",
+		_queueDevices[i] + 1, i + 1, i);
+
+      for (i = 0; i < _events.size(); ++i)
+      {
+	const Event& e = _events[i];
+
+	fprintf(file, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+		escape(e.name).c_str(), e.category, e.pid, e.tid, e.tsUs, e.durUs);
+      }
+
+      fprintf(file, "\n]}\n");
+      fclose(file);
+
+      fprintf(stderr, "Trace ecrite dans '%s' (%lu evenements)\r\n", _path.c_str(), _events.size());
+
+      return true;
+    }
+
+  private:
+
+    struct Event
+    {
+      Event(const std::string& name, const char* category, int pid, int tid, double tsUs, double durUs)
+	: name(name), category(category), pid(pid), tid(tid), tsUs(tsUs), durUs(durUs) {}
+
+      std::string name;
+      const char* category;
+      int pid;			// 0: host, n + 1: device n
+      int tid;			// 0: thread host, n + 1: file de commandes n
+      double tsUs;
+      double durUs;
+    };
+
+    struct PendingCommand
+    {
+      std::string name;
+      const char* category;
+      cl::Event event;
+      double hostEnqueueUs;
+      int queueId;
+      int deviceId;
+    };
+
+    Trace()
+      : _origin(std::chrono::steady_clock::now())
+    {
+      const char* path = getenv("KITE_TRACE");
+
+      if (path != NULL)
+	_path = path;
+    }
+
+    int queueId(const cl::CommandQueue& queue, int* deviceId)
+    {
+      cl::Device device;
+      std::map<cl_command_queue, int>::iterator it;
+
+      it = _queueIds.find(queue());
+      if (it != _queueIds.end())
+      {
+	*deviceId = _queueDevices[it->second];
+	return it->second;
+      }
+
+      queue.getInfo(CL_QUEUE_DEVICE, &device);
+      *deviceId = this->deviceId(device);
+
+      _queueIds[queue()] = _queueDevices.size();
+      _queueDevices.push_back(*deviceId);
+
+      return _queueDevices.size() - 1;
+    }
+
+    int deviceId(const cl::Device& device)
+    {
+      std::map<cl_device_id, int>::iterator it;
+
+      it = _deviceIds.find(device());
+      if (it != _deviceIds.end())
+	return it->second;
+
+      _deviceIds[device()] = _deviceNames.size();
+      _deviceNames.push_back(device.getInfo<CL_DEVICE_NAME>());
+
+      return _deviceNames.size() - 1;
+    }
+
+    /**
+     * Les horloges device et host n'ayant pas la meme origine, chaque commande est
+     * recalee sur la date host de sa soumission (CL_PROFILING_COMMAND_QUEUED).
+     */
+    void resolveCommands()
+    {
+      size_t i;
+
+      cl_ulong queued;
+      cl_ulong start;
+      cl_ulong end;
+
+      for (i = 0; i < _commands.size(); ++i)
+      {
+	PendingCommand& c = _commands[i];
+
+	try
+	{
+	  c.event.wait();
+
+	  queued = c.event.getProfilingInfo<CL_PROFILING_COMMAND_QUEUED>();
+	  start = c.event.getProfilingInfo<CL_PROFILING_COMMAND_START>();
+	  end = c.event.getProfilingInfo<CL_PROFILING_COMMAND_END>();
+	}
+	catch (const cl::Error& e)
+	{
+	  fprintf(stderr, "kite::Trace: commande '%s' non datee (%s)\r\n", c.name.c_str(), e.what());
+	  continue;
+	}
+
+	_events.push_back(Event(c.name, c.category, c.deviceId + 1, c.queueId + 1,
+				c.hostEnqueueUs + (start - queued) * 1e-3, (end - start) * 1e-3));
+      }
+
+      _commands.clear();
+    }
+
+    static std::string escape(const std::string& s)
+    {
+      size_t i;
+      std::string escaped;
+
+      for (i = 0; i < s.size(); ++i)
+      {
+	if (s[i] == '"' || s[i] == '\\')
+	  escaped += '\\';
+	escaped += s[i];
+      }
+
+      return escaped;
+    }
+
+    std::string _path;
+    std::chrono::steady_clock::time_point _origin;
+
+    std::vector<Event> _events;
+    std::vector<PendingCommand> _commands;
+
+    std::map<cl_command_queue, int> _queueIds;
+    std::vector<int> _queueDevices;
+
+    std::map<cl_device_id, int> _deviceIds;
+    std::vector<std::string> _deviceNames;
+
+    std::mutex _mutex;
+  };
+
+  /**
+   * Intervalle host enregistre dans la trace a la destruction de l'objet.
+   */
+  class TraceSpan
+  {
+  public:
+
+    TraceSpan(const std::string& name, const char* category = "host")
+      : _name(name), _category(category), _beginUs(Trace::instance().nowUs()) {}
+
+    ~TraceSpan()
+    {
+      Trace::instance().recordHostSpan(_name, _category, _beginUs, Trace::instance().nowUs());
+    }
+
+  private:
+
+    std::string _name;
+    const char* _category;
+    double _beginUs;
+  };
+}
+
+#endif